@@ -8,6 +8,8 @@ void setup()
 
 void loop()
 {
-    delay(5);
+    // wake up as soon as the audio callback queues flash operations, rather than sleeping a fixed time
+    FlashScheduler.WaitAndRun(5000);
+    DejaVu::DejaVuEffect::Service();
     Z4::loop();
 }
\ No newline at end of file
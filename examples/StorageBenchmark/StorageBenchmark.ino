@@ -0,0 +1,195 @@
+#include <new>
+#include "Polygons.h"
+#include "FlashReaderWriter.h"
+#include "IoScheduler.h"
+
+// Measures the SD card and prints which sample rate / block size combinations it can sustain for stereo overdubbing,
+// sweeps the compiled storage configurations (block size, channels, sample type), sweeps the audio block size to show
+// the fixed cost per callback, then compares the worst case flash operation latency of the legacy polling loop against the I/O scheduler.
+
+FlashReaderWriter rec(".bench");
+IntervalTimer audioTimer;
+float benchIn[BUFFER_SIZE];
+float benchOut[BUFFER_SIZE];
+
+// Audio block sizes for the callback sweep, 16 and 32 are the low latency settings
+const int CallbackBlockSizes[] = { 16, 32, 64, 128 };
+float sweepIn[128];
+float sweepOut[128];
+
+void printSustainable(const StorageThroughput& throughput)
+{
+    const int samplerates[] = { 44100, 48000, 88200, 96000 };
+    const int blockSizes[] = { 1024, 2048, 4096, 8192 };
+
+    Serial.println("samplerate  block  readahead  sustainable");
+    for (int fs : samplerates)
+    {
+        for (int blockSize : blockSizes)
+        {
+            int readAhead = ReadAheadBlocksFor(fs, blockSize);
+            bool ok = throughput.IsSustainable(fs, blockSize, readAhead, 2);
+            Serial.printf("%10d  %5d  %9d  %s%s\n", fs, blockSize, readAhead, ok ? "yes" : "no",
+                blockSize == StorageBlockSizeFor(fs) ? "  <- default" : "");
+        }
+    }
+}
+
+// Runs one storage configuration against the card and reports throughput, latency headroom and RAM.
+// Headroom is the read ahead window minus the worst case operation time, at the compiled sample rate.
+// Configurations that don't fit in the RAM left next to the benchmark's own channel are reported as n/a
+template <int BlockSize, int Channels, typename SampleT>
+void runConfiguration(const char* sampleName)
+{
+    typedef FlashReaderWriterT<BlockSize, Channels, SampleT> Config;
+    auto config = new (std::nothrow) Config(".sweep");
+    if (config == nullptr)
+    {
+        Serial.printf("%5d  %d  %-6s  n/a, the instance needs %d bytes\n", BlockSize, Channels, sampleName, (int)sizeof(Config));
+        return;
+    }
+
+    // Init leaves the buffer file empty when its block map can't be allocated
+    config->Init();
+    if (config->GetMaxLength() == 0)
+    {
+        Serial.printf("%5d  %d  %-6s  n/a, out of RAM after allocating %d bytes\n", BlockSize, Channels, sampleName, config->GetRamUsage());
+        delete config;
+        return;
+    }
+
+    auto throughput = config->MeasureThroughput(32);
+
+    int blockBytes = throughput.BlockBytes;
+    float writeMBs = (float)blockBytes * throughput.Blocks / throughput.WriteUs;
+    float readMBs = (float)blockBytes * throughput.Blocks / throughput.ReadUs;
+    int periodUs = (int)((long long)BlockSize * 1000000 / SAMPLERATE);
+    int worstUs = (int)(throughput.WorstReadUs > throughput.WorstWriteUs ? throughput.WorstReadUs : throughput.WorstWriteUs);
+    int headroomUs = periodUs * (config->GetReadAheadBlocks() - 1) - worstUs;
+    bool ok = throughput.IsSustainable(SAMPLERATE, BlockSize, config->GetReadAheadBlocks(), 2 / Channels, config->GetFrameBytes());
+
+    Serial.printf("%5d  %d  %-6s  %6.2f  %6.2f  %8d  %7d  %s\n", BlockSize, Channels, sampleName,
+        writeMBs, readMBs, headroomUs, config->GetRamUsage(), ok ? "yes" : "no");
+    delete config;
+}
+
+void runSweep()
+{
+    Serial.println("block  ch  sample  wr MB/s  rd MB/s  headroom  RAM      sustainable");
+    runConfiguration<1024, 1, float>("float");
+    runConfiguration<2048, 1, float>("float");
+    runConfiguration<4096, 1, float>("float");
+    runConfiguration<2048, 2, float>("float");
+    runConfiguration<1024, 1, int16_t>("int16");
+    runConfiguration<2048, 1, int16_t>("int16");
+    runConfiguration<4096, 1, int16_t>("int16");
+    runConfiguration<2048, 2, int16_t>("int16");
+    runConfiguration<4096, 2, int16_t>("int16");
+}
+
+// Times Process at each audio block size while overdubbing, the most expensive mode, and reports the CPU load for one
+// second of audio. Flash operations are serviced between batches and left out of the timing. With a low fixed cost
+// per callback, the load at 16 samples stays close to the load at 128
+void runCallbackSweep()
+{
+    for (int i = 0; i < 128; i++)
+        sweepIn[i] = 0.1f * sinf(i * 0.05f); // not silent, so every block is written
+
+    rec.SetFixedLength(SAMPLERATE * 4);
+    rec.SetMode(RecordingMode::Overdub);
+    rec.PreparePlay();
+
+    Serial.println("audio block  us per second  cpu load");
+    for (int bufSize : CallbackBlockSizes)
+    {
+        uint32_t totalUs = 0;
+        for (int frames = 0; frames < SAMPLERATE; frames += 512)
+        {
+            auto t1 = micros();
+            for (int i = 0; i < 512; i += bufSize)
+                rec.Process(sweepIn, sweepOut, bufSize);
+            totalUs += micros() - t1;
+            rec.ProcessFlashOperations();
+        }
+        Serial.printf("%11d  %13d  %7.2f%%\n", bufSize, (int)totalUs, totalUs / 10000.0f);
+    }
+
+    rec.SetMode(RecordingMode::Stopped);
+    rec.ProcessFlashOperations();
+}
+
+void simulatedAudioCallback()
+{
+    rec.Process(benchIn, benchOut, BUFFER_SIZE);
+}
+
+// stand-in for display redraws and menu handling, which share the main loop with flash I/O
+void simulatedUiWork(bool useScheduler)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        auto t1 = micros();
+        while (micros() - t1 < 1000)
+        {
+        }
+        if (useScheduler)
+            FlashScheduler.Poll();
+    }
+}
+
+void runLatencyBenchmark(bool useScheduler, uint32_t durationMs)
+{
+    rec.SetFixedLength(SAMPLERATE * 4);
+    rec.SetMode(RecordingMode::Overdub);
+    rec.PreparePlay();
+    rec.ResetDiagnostics();
+    audioTimer.begin(simulatedAudioCallback, BUFFER_SIZE * 1000000.0f / SAMPLERATE);
+
+    auto start = millis();
+    while (millis() - start < durationMs)
+    {
+        if (useScheduler)
+        {
+            FlashScheduler.WaitAndRun(5000);
+        }
+        else
+        {
+            delay(5);
+            rec.ProcessFlashOperations();
+        }
+        simulatedUiWork(useScheduler);
+    }
+
+    audioTimer.end();
+    rec.SetMode(RecordingMode::Stopped);
+    rec.ProcessFlashOperations();
+
+    auto diag = rec.GetDiagnostics();
+    Serial.printf("%-10s worst read %6d us, worst write %6d us, deadline misses %d, read misses %d, write overruns %d\n",
+        useScheduler ? "scheduler" : "polling",
+        (int)diag.MaxReadLatencyUs, (int)diag.MaxWriteLatencyUs, (int)diag.DeadlineMisses, (int)diag.ReadMisses, (int)diag.WriteOverruns);
+}
+
+void setup()
+{
+    Polygons::init();
+    rec.Init();
+    FlashScheduler.Register(&rec);
+
+    auto throughput = rec.MeasureThroughput(64);
+    Serial.printf("Block of %d bytes: write avg %d us, worst %d us; read avg %d us, worst %d us\n",
+        throughput.BlockBytes,
+        (int)(throughput.WriteUs / throughput.Blocks), (int)throughput.WorstWriteUs,
+        (int)(throughput.ReadUs / throughput.Blocks), (int)throughput.WorstReadUs);
+    printSustainable(throughput);
+    runSweep();
+    runCallbackSweep();
+
+    runLatencyBenchmark(false, 10000);
+    runLatencyBenchmark(true, 10000);
+}
+
+void loop()
+{
+    delay(1000);
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+
+// Single pass kernels for the block write path. The Cortex-M7 has no float SIMD, so the loops are unrolled by four
+// to let the compiler keep the FPU pipeline busy; Count is a compile time constant at every call site.
+// The audio buffer kernels at the end take the audio block size at run time.
+
+// dest = input + feedback * existing, and clears input for the next block.
+// feedback = 1 is a plain overdub, feedback = 0 replaces the existing loop.
+// Returns the peak of dest and its sum of squares, gathered in the same pass for the loop envelope.
+template <int Count>
+inline float OverdubBlock(float* dest, float* input, const float* existing, float feedback, float* sumSquares)
+{
+    static_assert(Count % 4 == 0, "Block size must be a multiple of 4");
+    float peak = 0.0f;
+    float sum = 0.0f;
+    for (int i = 0; i < Count; i += 4)
+    {
+        float a0 = input[i] + feedback * existing[i];
+        float a1 = input[i + 1] + feedback * existing[i + 1];
+        float a2 = input[i + 2] + feedback * existing[i + 2];
+        float a3 = input[i + 3] + feedback * existing[i + 3];
+        dest[i] = a0;
+        dest[i + 1] = a1;
+        dest[i + 2] = a2;
+        dest[i + 3] = a3;
+        input[i] = 0;
+        input[i + 1] = 0;
+        input[i + 2] = 0;
+        input[i + 3] = 0;
+        sum += a0 * a0 + a1 * a1 + a2 * a2 + a3 * a3;
+        float m01 = fabsf(a0) > fabsf(a1) ? fabsf(a0) : fabsf(a1);
+        float m23 = fabsf(a2) > fabsf(a3) ? fabsf(a2) : fabsf(a3);
+        float m = m01 > m23 ? m01 : m23;
+        peak = m > peak ? m : peak;
+    }
+    *sumSquares = sum;
+    return peak;
+}
+
+// dest = input, and clears input for the next block. Returns the peak and sum of squares like OverdubBlock
+template <int Count>
+inline float MoveBlock(float* dest, float* input, float* sumSquares)
+{
+    static_assert(Count % 4 == 0, "Block size must be a multiple of 4");
+    float peak = 0.0f;
+    float sum = 0.0f;
+    for (int i = 0; i < Count; i += 4)
+    {
+        float a0 = input[i];
+        float a1 = input[i + 1];
+        float a2 = input[i + 2];
+        float a3 = input[i + 3];
+        dest[i] = a0;
+        dest[i + 1] = a1;
+        dest[i + 2] = a2;
+        dest[i + 3] = a3;
+        input[i] = 0;
+        input[i + 1] = 0;
+        input[i + 2] = 0;
+        input[i + 3] = 0;
+        sum += a0 * a0 + a1 * a1 + a2 * a2 + a3 * a3;
+        float m01 = fabsf(a0) > fabsf(a1) ? fabsf(a0) : fabsf(a1);
+        float m23 = fabsf(a2) > fabsf(a3) ? fabsf(a2) : fabsf(a3);
+        float m = m01 > m23 ? m01 : m23;
+        peak = m > peak ? m : peak;
+    }
+    *sumSquares = sum;
+    return peak;
+}
+
+// dest = src, returning the largest magnitude copied. Used on the audio buffer path, where the count is the audio
+// block size, so the peak of a storage block builds up as the audio arrives instead of in a pass of its own
+inline float CopyPeak(float* dest, const float* src, int count)
+{
+    float peak = 0.0f;
+    for (int i = 0; i < count; i++)
+    {
+        float val = src[i];
+        dest[i] = val;
+        float mag = val < 0.0f ? -val : val;
+        peak = mag > peak ? mag : peak;
+    }
+    return peak;
+}
+
+// dest = (dest + input) * gain, input monitoring and output gain in one pass over the audio buffer
+inline void MixGain(float* dest, const float* input, float gain, int count)
+{
+    for (int i = 0; i < count; i++)
+        dest[i] = (dest[i] + input[i]) * gain;
+}
+
+// dest = src * gain, returning the peak of dest and adding its squares to sumSquares. Used when packing blocks for a
+// save, so the levels of the saved blocks come out of the packing pass
+inline float CopyGainLevel(float* dest, const float* src, int count, float gain, float* sumSquares)
+{
+    float peak = 0.0f;
+    float sum = 0.0f;
+    for (int i = 0; i < count; i++)
+    {
+        float val = src[i] * gain;
+        dest[i] = val;
+        float mag = val < 0.0f ? -val : val;
+        peak = mag > peak ? mag : peak;
+        sum += val * val;
+    }
+    *sumSquares += sum;
+    return peak;
+}
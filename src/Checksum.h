@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+
+// Fletcher-style running checksum over 32 bit words.
+// Cheap enough to run over every block on the streaming path, and order-sensitive, so swapped or shifted blocks are detected.
+struct Checksum
+{
+    uint32_t A = 0;
+    uint32_t B = 0;
+
+    inline void Update(const void* data, int byteCount)
+    {
+        auto words = (const uint32_t*)data;
+        int count = byteCount / 4;
+        uint32_t a = A;
+        uint32_t b = B;
+        for (int i = 0; i < count; i++)
+        {
+            a += words[i];
+            b += a;
+        }
+        A = a;
+        B = b;
+    }
+
+    inline uint32_t Value() const
+    {
+        // never return 0, that value is reserved for "no checksum available"
+        uint32_t value = A ^ (B << 16 | B >> 16);
+        return value == 0 ? 1 : value;
+    }
+
+    static inline uint32_t Of(const void* data, int byteCount)
+    {
+        Checksum sum;
+        sum.Update(data, byteCount);
+        return sum.Value();
+    }
+};
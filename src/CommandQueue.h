@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+
+// Wait-free single producer, single consumer queue.
+// The producer only writes Head and the consumer only writes Tail, so neither side ever blocks or disables
+// interrupts. Used to hand commands from the UI to the audio callback, which drains the queue at its start.
+template <typename T, int Size>
+class SpscQueue
+{
+    static_assert(Size >= 2, "One slot is always kept free to tell a full queue from an empty one");
+
+    T Items[Size];
+    volatile int Head = 0;
+    volatile int Tail = 0;
+
+public:
+    // Producer side. Returns false when the queue is full, the item is dropped
+    inline bool Push(const T& item)
+    {
+        int head = Head;
+        int next = (head + 1) % Size;
+        if (next == Tail)
+            return false;
+
+        Items[head] = item;
+        // the item must be complete before the consumer can see it
+        __sync_synchronize();
+        Head = next;
+        return true;
+    }
+
+    // Consumer side. Returns false when there is nothing to take
+    inline bool Pop(T* item)
+    {
+        int tail = Tail;
+        if (tail == Head)
+            return false;
+
+        __sync_synchronize();
+        *item = Items[tail];
+        __sync_synchronize();
+        Tail = (tail + 1) % Size;
+        return true;
+    }
+
+    inline bool IsEmpty() const
+    {
+        return Tail == Head;
+    }
+};
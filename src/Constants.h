@@ -1,5 +1,11 @@
 #pragma once
 #include "AudioConfig.h"
 
+// The audio block size follows the audio library. Build with AUDIO_BLOCK_SAMPLES=16 or 32 for low latency
+// monitoring; storage blocks are sized independently and only need to be a multiple of it
 #define BUFFER_SIZE AUDIO_BLOCK_SAMPLES
-#define FS_MAX 48000
+// Highest sample rate the storage geometry is laid out for: 4096 sample blocks read 3 ahead at 96 kHz
+#define FS_MAX 96000
+
+static_assert(BUFFER_SIZE >= 16 && (BUFFER_SIZE & (BUFFER_SIZE - 1)) == 0, "Audio block size must be a power of two of at least 16");
+static_assert(SAMPLERATE <= FS_MAX, "Sample rate above FS_MAX, the storage geometry hasn't been checked for it");
@@ -7,11 +7,27 @@
 //#include "Z4Rev.h"
 #include "blocks/DelayBlockExternal.h"
 #include "FlashReaderWriter.h"
+#include "IoScheduler.h"
+#include "CommandQueue.h"
 
 using namespace Polygons;
 
 namespace DejaVu
 {
+	enum class TransportCommand : uint8_t
+	{
+		Record = 0,
+		StartStop = 1,
+		Overdub = 2,
+		JumpToSlice = 3,
+	};
+
+	struct TransportMessage
+	{
+		TransportCommand Command;
+		int Argument;
+	};
+
 	class ControllerDejaVu
 	{
 	private:
@@ -20,6 +36,22 @@ namespace DejaVu
 		float outGain;
 		uint16_t parameters[Parameter::COUNT];
 		int loopLength;
+		bool bandwidthOk;
+		volatile bool loopFull;
+		int maxLoopSamples;
+
+		// Transport commands are posted by the UI and applied at the start of the next audio callback, so a mode
+		// change never lands halfway through a callback and never needs the audio interrupt disabled.
+		// Work the callback can't do (reading the cue blocks) is flagged and picked up by ServiceTransport
+		SpscQueue<TransportMessage, 16> transportQueue;
+		volatile bool cuesDirty;
+		volatile bool transportChanged;
+
+		// Bpm and Len Type move the cue grid. Rebuilding the cues reads a block per cue, so it waits until the encoder
+		// has rested for CueSettleMs instead of running on every step
+		const static uint32_t CueSettleMs = 300;
+		bool cueGridChanged;
+		uint32_t cueGridChangedMs;
 
 	public:
 		FlashReaderWriter recl, recr;
@@ -29,15 +61,139 @@ namespace DejaVu
 			this->samplerate = samplerate;
 			outGain = 1.0;
 			loopLength = 0;
+			bandwidthOk = true;
+			loopFull = false;
+			maxLoopSamples = 0;
+			cuesDirty = false;
+			transportChanged = false;
+			cueGridChanged = false;
+			cueGridChangedMs = 0;
 		}
 
 		void Init()
 		{
-			recl.Init();
-			recr.Init();
+			recl.Init(2);
+			recr.Init(1);
+			FlashScheduler.Register(&recl);
+			FlashScheduler.Register(&recr);
+			maxLoopSamples = GetMaxLoopSamples();
+
+			// Check up front that the card can sustain overdubbing both channels at the configured sample rate
+			auto throughput = recl.MeasureThroughput();
+			bandwidthOk = throughput.IsSustainable(samplerate, recl.GetBlockSize(), recl.GetReadAheadBlocks(), 2);
+			if (!bandwidthOk)
+				LogErrorf("SD card cannot sustain %d Hz with %d sample blocks and %d blocks read ahead", samplerate, recl.GetBlockSize(), recl.GetReadAheadBlocks())
+			else
+				LogInfof("Storage configured for %d Hz: %d sample blocks, %d blocks read ahead", samplerate, recl.GetBlockSize(), recl.GetReadAheadBlocks())
+			LogInfof("Maximum loop length: %d seconds", GetMaxLoopSamples() / samplerate)
+		}
+
+		bool IsBandwidthOk()
+		{
+			return bandwidthOk;
+		}
+
+		int GetMaxLoopSamples()
+		{
+			return recl.GetMaxLength() < recr.GetMaxLength() ? recl.GetMaxLength() : recr.GetMaxLength();
+		}
+
+		// Slices both channels can jump to
+		int GetCueCount()
+		{
+			return recl.GetCueCount() < recr.GetCueCount() ? recl.GetCueCount() : recr.GetCueCount();
+		}
+
+		// True once after a recording was closed because it reached the end of the buffer files
+		bool TakeLoopFullWarning()
+		{
+			bool full = loopFull;
+			loopFull = false;
+			return full;
+		}
+
+		// Gain that brings the loop's peak to just below full scale, taken from the loop envelopes so the loop is
+		// not read back. Both channels get the same gain to keep the stereo image. 1 when the peak is unknown
+		float GetNormaliseGain()
+		{
+			// writes still queued would otherwise be missing from the envelopes
+			FlashScheduler.Run();
+			float peakL = recl.GetLoopPeak();
+			float peakR = recr.GetLoopPeak();
+			float peak = peakL > peakR ? peakL : peakR;
+			if (peakL < 0 || peakR < 0 || peak < 0.001f)
+				return 1.0f;
+			return 0.98f / peak;
 		}
 
 		void TriggerRecord()
+		{
+			PostTransport(TransportCommand::Record);
+		}
+
+		void TriggerStartStop()
+		{
+			PostTransport(TransportCommand::StartStop);
+		}
+
+		void TriggerOverdub()
+		{
+			PostTransport(TransportCommand::Overdub);
+		}
+
+		// Jumps to the slice at the next block boundary, starting playback from it when stopped
+		void JumpToSlice(int slice)
+		{
+			PostTransport(TransportCommand::JumpToSlice, slice);
+		}
+
+		void PostTransport(TransportCommand command, int argument = 0)
+		{
+			TransportMessage message = { command, argument };
+			if (!transportQueue.Push(message))
+				LogWarn("Transport queue full, dropping command")
+		}
+
+		// Called from the loop context. Reloads the cue points after a recording was closed, and returns true when
+		// the transport changed since the last call, so the LEDs can follow
+		bool ServiceTransport()
+		{
+			bool gridSettled = cueGridChanged && millis() - cueGridChangedMs >= CueSettleMs;
+			if (cuesDirty || gridSettled)
+			{
+				cuesDirty = false;
+				cueGridChanged = false;
+				UpdateCuePoints();
+			}
+			bool changed = transportChanged;
+			transportChanged = false;
+			return changed;
+		}
+
+	private:
+		static void PollScheduler()
+		{
+			FlashScheduler.Poll();
+		}
+
+		// Audio callback only, applies everything the UI posted since the last callback
+		void ApplyTransport()
+		{
+			TransportMessage message;
+			while (transportQueue.Pop(&message))
+			{
+				switch (message.Command)
+				{
+					case TransportCommand::Record:		ApplyRecord(); break;
+					case TransportCommand::StartStop:	ApplyStartStop(); break;
+					case TransportCommand::Overdub:		ApplyOverdub(); break;
+					case TransportCommand::JumpToSlice:	ApplyJumpToSlice(message.Argument); break;
+				}
+				transportChanged = true;
+			}
+		}
+
+		void ApplyRecord()
 		{
 			if (recl.GetMode() == RecordingMode::Recording)
 			{
@@ -48,7 +204,7 @@ namespace DejaVu
 				recr.AdvanceWrite();
 				recl.SetMode(RecordingMode::Playback);
 				recr.SetMode(RecordingMode::Playback);
-				
+				cuesDirty = true;
 			}
 			else
 			{
@@ -63,7 +219,7 @@ namespace DejaVu
 			recr.PreparePlay();
 		}
 
-		void TriggerStartStop()
+		void ApplyStartStop()
 		{
 			if (recl.GetMode() == RecordingMode::Recording)
 			{
@@ -74,15 +230,14 @@ namespace DejaVu
 				recr.AdvanceWrite();
 				recl.SetMode(RecordingMode::Stopped);
 				recr.SetMode(RecordingMode::Stopped);
-			}
-			else if (recl.GetMode() == RecordingMode::Overdub)
-			{
-				recl.SetMode(RecordingMode::Stopped);
-				recr.SetMode(RecordingMode::Stopped);
+				cuesDirty = true;
 			}
 			else
 			{
-				auto playState = recl.GetMode() == RecordingMode::Playback ? RecordingMode::Stopped : RecordingMode::Playback;
+				// a block overdubbed part way must be stored before PreparePlay moves the position back to the start
+				recl.FlushOverdub();
+				recr.FlushOverdub();
+				auto playState = recl.GetMode() == RecordingMode::Stopped ? RecordingMode::Playback : RecordingMode::Stopped;
 				recl.SetMode(playState);
 				recr.SetMode(playState);
 			}
@@ -91,7 +246,7 @@ namespace DejaVu
 			recr.PreparePlay();
 		}
 
-		void TriggerOverdub()
+		void ApplyOverdub()
 		{
 			// overdub disabled when recording base loop
 			if (recl.GetMode() == RecordingMode::Recording)
@@ -116,6 +271,76 @@ namespace DejaVu
 			}
 		}
 
+		void ApplyJumpToSlice(int slice)
+		{
+			// a slice only one channel could cache would pull the channels apart
+			if (recl.GetMode() == RecordingMode::Recording || slice < 0 || slice >= GetCueCount())
+				return;
+
+			if (recl.GetMode() == RecordingMode::Stopped)
+			{
+				// nothing is playing, so there is no block boundary to wait for
+				recl.SetMode(RecordingMode::Playback);
+				recr.SetMode(RecordingMode::Playback);
+				recl.PreparePlay();
+				recr.PreparePlay();
+				recl.StartAtCue(slice);
+				recr.StartAtCue(slice);
+				return;
+			}
+
+			recl.JumpToCue(slice);
+			recr.JumpToCue(slice);
+		}
+
+	public:
+		// Places cue points on the beat or bar grid of the Bpm setting, bars when the loop length is set in seconds
+		void UpdateCuePoints()
+		{
+			int bpm = GetScaledParameter(Parameter::Bpm);
+			int beats = GetScaledParameter(Parameter::SetLengthMode) == 1 ? 1 : 4;
+			int spacing = (int)((double)samplerate * 60 * beats / bpm);
+			// the cue blocks are read between scheduler polls, so loop reads due meanwhile aren't held up
+			recl.SetCuePoints(spacing, PollScheduler);
+			recr.SetCuePoints(spacing, PollScheduler);
+		}
+
+		// Multiplies the loop by 2 or 4, or appends 1, 2 or 4 silent bars at the Bpm setting. Only the block maps change,
+		// so the loop keeps playing without a gap
+		bool ApplyLoopEdit()
+		{
+			if (recl.GetMode() == RecordingMode::Recording)
+				return false;
+
+			int edit = GetScaledParameter(Parameter::LoopEdit);
+			bool ok;
+			if (edit < 2)
+			{
+				int factor = edit == 0 ? 2 : 4;
+				ok = recl.CanMultiply(factor) && recr.CanMultiply(factor);
+				if (ok)
+				{
+					recl.MultiplyLoop(factor);
+					recr.MultiplyLoop(factor);
+				}
+			}
+			else
+			{
+				int bars = 1 << (edit - 2);
+				int frames = (int)((double)samplerate * 60 * 4 * bars / GetScaledParameter(Parameter::Bpm));
+				ok = recl.CanInsertSilence(frames) && recr.CanInsertSilence(frames);
+				if (ok)
+				{
+					recl.InsertSilence(frames);
+					recr.InsertSilence(frames);
+				}
+			}
+
+			if (ok)
+				UpdateCuePoints();
+			return ok;
+		}
+
 		int GetSamplerate()
 		{
 			return samplerate;
@@ -150,12 +375,14 @@ namespace DejaVu
 		{
 			int bpm = GetScaledParameter(Parameter::Bpm);
 			double val = GetSetLenValue();
+			int samples;
 			if (GetScaledParameter(Parameter::SetLengthMode) == 0) // seconds
-				return val * samplerate;
+				samples = val * samplerate;
 			else if (GetScaledParameter(Parameter::SetLengthMode) == 1) // beats
-				return (val / bpm) * 60 * samplerate;
+				samples = (val / bpm) * 60 * samplerate;
 			else // bars, 4x4 assumed
-				return (val / bpm) * 60 * 4 * samplerate;
+				samples = (val / bpm) * 60 * 4 * samplerate;
+			return samples > GetMaxLoopSamples() ? GetMaxLoopSamples() : samples;
 		}
 
 		double GetScaledParameter(int param)
@@ -169,6 +396,10 @@ namespace DejaVu
 				case Parameter::SetLength:		return GetSetLenValue();
 				case Parameter::SetLengthMode:	return (int)(P(param) * 2.999);
 				case Parameter::Bpm:			return (int)10 + (int)(P(param) * 290);
+				case Parameter::Slice:			return 1+(int)(P(param) * (MaxCuePoints - 0.001));
+				case Parameter::Feedback:		return (int)(P(param) * 100 + 0.5); // percent
+				case Parameter::LoopEdit:		return (int)(P(param) * 4.999);
+				case Parameter::SaveMode:		return (int)(P(param) * 1.999);
 			}
 			return parameters[param];
 		}		
@@ -179,26 +410,37 @@ namespace DejaVu
 			auto scaled = GetScaledParameter(param);
 			if (param == Parameter::OutGain)
 				outGain = DB2gain(scaled);
+			if (param == Parameter::Bpm || param == Parameter::SetLengthMode)
+			{
+				cueGridChanged = true;
+				cueGridChangedMs = millis();
+			}
+			if (param == Parameter::Feedback)
+			{
+				recl.SetOverdubFeedback(scaled / 100.0);
+				recr.SetOverdubFeedback(scaled / 100.0);
+			}
 		}
 
 		void Process(float** inputs, float** outputs, int bufferSize)
 		{
-			auto b1 = Buffers::Request();
-			auto b2 = Buffers::Request();
-			auto bufPlayback = b1.Ptr;
-			auto bufOverdubbed = b2.Ptr;
-			ZeroBuffer(bufPlayback, bufferSize);
-			ZeroBuffer(bufOverdubbed, bufferSize);
-			ZeroBuffer(outputs[0], bufferSize);
-			ZeroBuffer(outputs[1], bufferSize);
+			ApplyTransport();
 
+			// the loop channels fill or clear the outputs, the input monitoring and output gain go in a single pass
 			recl.Process(inputs[0], outputs[0], bufferSize);
 			recr.Process(inputs[1], outputs[1], bufferSize);
-			Mix(outputs[0], inputs[0], 1.0, bufferSize);
-			Mix(outputs[1], inputs[1], 1.0, bufferSize);
-			Gain(outputs[0], outGain, bufferSize);
-			Gain(outputs[1], outGain, bufferSize);
+			MixGain(outputs[0], inputs[0], outGain, bufferSize);
+			MixGain(outputs[1], inputs[1], outGain, bufferSize);
 			loopLength += bufferSize;
+
+			// close the loop before a free recording runs past the end of the buffer files
+			if (recl.GetMode() == RecordingMode::Recording && loopLength + bufferSize > maxLoopSamples)
+			{
+				LogWarnf("Recording reached the maximum loop length of %d samples", loopLength)
+				ApplyRecord();
+				transportChanged = true;
+				loopFull = true;
+			}
 		}
 		
 	private:
@@ -4,6 +4,7 @@
 #include "Constants.h"
 #include "ParameterDejaVu.h"
 #include "ControllerDejaVu.h"
+#include "LevelMeter.h"
 #include "Utils.h"
 #include "EffectBase.h"
 
@@ -18,6 +19,8 @@ namespace DejaVu
         float BufferOutL[BUFFER_SIZE];
         float BufferOutR[BUFFER_SIZE];
         int InputClip, OutputClip = 0;
+        ChannelMeter InputMeter[2];
+        ChannelMeter OutputMeter[2];
         bool settingsDirty = false;
         ControllerDejaVu controller;
 
@@ -34,6 +37,10 @@ namespace DejaVu
             ParameterNames[Parameter::SetLength] = "Set Len";
             ParameterNames[Parameter::SetLengthMode] = "Len Type";
             ParameterNames[Parameter::Bpm] = "BPM";
+            ParameterNames[Parameter::Slice] = "Slice";
+            ParameterNames[Parameter::Feedback] = "Feedback";
+            ParameterNames[Parameter::LoopEdit] = "Extend";
+            ParameterNames[Parameter::SaveMode] = "Save Mode";
         }
 
         inline void SetIOConfig()
@@ -53,15 +60,20 @@ namespace DejaVu
             os.Register(Parameter::SetLength,      1023, Polygons::ControlMode::Encoded, 4, 1);
             os.Register(Parameter::SetLengthMode,  1023, Polygons::ControlMode::Encoded, 5, 16);
             os.Register(Parameter::Bpm,            1023, Polygons::ControlMode::Encoded, 6, 1);
+            os.Register(Parameter::Slice,          1023, Polygons::ControlMode::Encoded, 7, 16);
+            os.Register(Parameter::Feedback,       1023, Polygons::ControlMode::Encoded, 11, 2);
+            os.Register(Parameter::LoopEdit,       1023, Polygons::ControlMode::Encoded, 12, 16);
+            os.Register(Parameter::SaveMode,       1023, Polygons::ControlMode::Encoded, 13, 16);
         }
 
         virtual void GetPageName(int page, char* dest) override
         {
-            if (page == 4 && InputClip)
+            // the clip warnings sit over the gain they call for, so they never hide a click hint
+            if (page == 0 && InputClip)
                 strcpy(dest, " !!IN CLIP!!");
-            else if (page == 7 && OutputClip)
+            else if (page == 1 && OutputClip)
                 strcpy(dest, " !!OUT CLIP!!");
-            else if (page == 2 || page == 3 || page == 4)
+            else if (page == 2 || page == 3 || page == 4 || page == 7 || page == 12)
                 strcpy(dest, "<Click>");
             else
                 strcpy(dest, "");
@@ -82,10 +94,28 @@ namespace DejaVu
             {
                 sprintf(dest, "%.1fdB", val);
             }
-            else if (paramId == Parameter::LoadSlot || paramId == Parameter::SaveSlot || paramId == Parameter::Bpm)
+            else if (paramId == Parameter::LoadSlot)
+            {
+                auto info = controller.recl.GetSlotInfo((int)val);
+                if (info == nullptr || !info->IsPopulated())
+                    sprintf(dest, "%d (empty)", (int)val);
+                else if (info->Bpm > 0)
+                    sprintf(dest, "%d (%.1fs %dbpm)", (int)val, info->TotalLength / (double)controller.GetSamplerate(), (int)info->Bpm);
+                else
+                    sprintf(dest, "%d (%.1fs)", (int)val, info->TotalLength / (double)controller.GetSamplerate());
+            }
+            else if (paramId == Parameter::SaveSlot || paramId == Parameter::Bpm)
             {
                 sprintf(dest, "%d", (int)val);
             }
+            else if (paramId == Parameter::Slice)
+            {
+                int cueCount = controller.GetCueCount();
+                if (cueCount == 0)
+                    strcpy(dest, "---");
+                else
+                    sprintf(dest, "%d / %d", (int)val, cueCount);
+            }
             else if (paramId == Parameter::SetLength)
             {
                 if (controller.GetScaledParameter(Parameter::SetLengthMode) == 0)
@@ -95,6 +125,26 @@ namespace DejaVu
                 else if (controller.GetScaledParameter(Parameter::SetLengthMode) == 2)
                     sprintf(dest, "%d bars", (int)val);
             }
+            else if (paramId == Parameter::Feedback)
+            {
+                if (val == 0)
+                    strcpy(dest, "Replace");
+                else
+                    sprintf(dest, "%d%%", (int)val);
+            }
+            else if (paramId == Parameter::LoopEdit)
+            {
+                if (val == 0)
+                    strcpy(dest, "x2");
+                else if (val == 1)
+                    strcpy(dest, "x4");
+                else
+                    sprintf(dest, "+%d bar%s", 1 << ((int)val - 2), val == 2 ? "" : "s");
+            }
+            else if (paramId == Parameter::SaveMode)
+            {
+                strcpy(dest, val == 0 ? "As is" : "Normalise");
+            }
             else if (paramId == Parameter::SetLengthMode)
             {
                 if (val == 0)
@@ -149,6 +199,7 @@ namespace DejaVu
                     os.menu.setMessage("Slot is empty!", 1000);
                 else if (resl == 0 && resr == 0)
                     os.menu.setMessage("Loaded!", 1000);
+                controller.UpdateCuePoints();
 
                 return true;
             }
@@ -158,8 +209,10 @@ namespace DejaVu
                 os.redrawDisplay();
                 Polygons::pushDisplayFull();
                 int slot = controller.GetScaledParameter(Parameter::SaveSlot);
-                controller.recl.SaveRecording(slot);
-                controller.recr.SaveRecording(slot);
+                int bpm = controller.GetScaledParameter(Parameter::Bpm);
+                float gain = controller.GetScaledParameter(Parameter::SaveMode) == 1 ? controller.GetNormaliseGain() : 1.0f;
+                controller.recl.SaveRecording(slot, bpm, gain);
+                controller.recr.SaveRecording(slot, bpm, gain);
                 os.menu.setMessage("Stored!", 1000);
                 return true;
             }
@@ -171,25 +224,37 @@ namespace DejaVu
                 int sampleCount = controller.GetSetLenValueSamples();
                 controller.recl.SetFixedLength(sampleCount);
                 controller.recr.SetFixedLength(sampleCount);
+                controller.UpdateCuePoints();
                 os.menu.setMessage("Loop set", 1000);
                 return true;
             }
+            if (update->Type == MessageType::Digital && update->Index == 7 && update->Value > 0)
+            {
+                int slice = controller.GetScaledParameter(Parameter::Slice);
+                controller.JumpToSlice(slice - 1);
+                return true;
+            }
+            if (update->Type == MessageType::Digital && update->Index == 12 && update->Value > 0)
+            {
+                if (controller.ApplyLoopEdit())
+                    os.menu.setMessage("Loop extended", 1000);
+                else
+                    os.menu.setMessage("Loop too long!", 1000);
+                return true;
+            }
             if (update->Type == MessageType::Digital && update->Index == 8 && update->Value > 0)
             {
                 controller.TriggerRecord();
-                SetLeds();
                 return true;
             }
             if (update->Type == MessageType::Digital && update->Index == 9 && update->Value > 0)
             {
                 controller.TriggerOverdub();
-                SetLeds();
                 return true;
             }
             else if (update->Type == MessageType::Digital && update->Index == 10 && update->Value > 0)
             {
                 controller.TriggerStartStop();
-                SetLeds();
                 return true;
             }
             
@@ -198,16 +263,80 @@ namespace DejaVu
 
         virtual void CustomDrawCallback()
         {
+            // redraws are slow, make sure pending reads aren't held up behind them
+            FlashScheduler.Poll();
             auto canvas = Polygons::getCanvas();
             canvas->fillRect(0, 0, 64, 10, 0); // remove the selected page highlighting
+            DrawLoopOverview(0, 0, 48, 10);
+            DrawMeter(50, 0, 10, InputMeter[0]);
+            DrawMeter(53, 0, 10, InputMeter[1]);
+            DrawMeter(58, 0, 10, OutputMeter[0]);
+            DrawMeter(61, 0, 10, OutputMeter[1]);
+        }
+
+        // Level codes are on a dB scale, so bars drawn from them read like a meter
+        static int LevelHeight(int code, int height)
+        {
+            return code * height / 256;
+        }
+
+        // Draws the loop's envelope with the playhead from the levels kept in RAM, the card is never read.
+        // Each column is filled up to the loudest block's RMS, with a dot at its peak
+        void DrawLoopOverview(int x, int y, int width, int height)
+        {
+            auto envelopeL = controller.recl.GetEnvelope();
+            auto envelopeR = controller.recr.GetEnvelope();
+            int blocks = controller.recl.GetBlockCount();
+            int length = controller.recl.GetLength();
+            if (envelopeL == nullptr || envelopeR == nullptr || blocks == 0 || length == 0)
+                return;
+
+            auto canvas = Polygons::getCanvas();
+            for (int col = 0; col < width; col++)
+            {
+                int first = col * blocks / width;
+                int last = (col + 1) * blocks / width;
+                int peak = 0;
+                int rms = 0;
+                for (int i = first; i < last || i == first; i++)
+                {
+                    peak = envelopeL[i].Peak > peak ? envelopeL[i].Peak : peak;
+                    peak = envelopeR[i].Peak > peak ? envelopeR[i].Peak : peak;
+                    rms = envelopeL[i].Rms > rms ? envelopeL[i].Rms : rms;
+                    rms = envelopeR[i].Rms > rms ? envelopeR[i].Rms : rms;
+                }
+                int bar = LevelHeight(rms, height);
+                if (bar > 0)
+                    canvas->drawFastVLine(x + col, y + height - bar, bar, 1);
+                int top = LevelHeight(peak, height);
+                if (top > 0)
+                    canvas->drawPixel(x + col, y + height - top, 1);
+            }
+
+            int playhead = (int)((int64_t)controller.recl.GetPlayPosition() * width / length);
+            if (controller.recl.GetMode() != RecordingMode::Stopped && playhead >= 0 && playhead < width)
+                canvas->drawFastVLine(x + playhead, y, height, 1);
+        }
+
+        // Two pixel wide meter: filled to the RMS, with a line at the held peak
+        void DrawMeter(int x, int y, int height, const ChannelMeter& meter)
+        {
+            auto canvas = Polygons::getCanvas();
+            int bar = LevelHeight(EncodeLevel(meter.GetRms()), height);
+            if (bar > 0)
+                canvas->fillRect(x, y + height - bar, 2, bar, 1);
+            int top = LevelHeight(EncodeLevel(meter.GetPeak()), height);
+            if (top > 0)
+                canvas->drawFastHLine(x, y + height - top, 2, 1);
         }
 
         virtual void AudioCallback(int32_t** inputs, int32_t** outputs, int bufferSize) override
         {
             IntBuffer2Float(BufferInL, inputs[0], bufferSize);
             IntBuffer2Float(BufferInR, inputs[1], bufferSize);
-            float maxInL = MaxAbsF(BufferInL, bufferSize);
-            float maxInR = MaxAbsF(BufferInR, bufferSize);
+            // the meters take peak and RMS in the pass that used to only find the peak for the clip warning
+            float maxInL = InputMeter[0].Measure(BufferInL, bufferSize);
+            float maxInR = InputMeter[1].Measure(BufferInR, bufferSize);
             
             if (maxInL >= 0.88 || maxInR >= 0.88)
                 InputClip = 2000;
@@ -220,8 +349,8 @@ namespace DejaVu
             
             FloatBuffer2Int(outputs[0], BufferOutL, bufferSize);
             FloatBuffer2Int(outputs[1], BufferOutR, bufferSize);
-            float maxOutL = MaxAbsF(BufferOutL, bufferSize);
-            float maxOutR = MaxAbsF(BufferOutR, bufferSize);
+            float maxOutL = OutputMeter[0].Measure(BufferOutL, bufferSize);
+            float maxOutR = OutputMeter[1].Measure(BufferOutR, bufferSize);
 
             if (maxOutL >= 0.98 || maxOutR >= 0.98)
                 OutputClip = 2000;
@@ -235,6 +364,8 @@ namespace DejaVu
         {
             AudioDisable();
             uint16_t storedParameters[32];
+            // settings stored by older versions have fewer parameters, the rest keep their defaults
+            memcpy(storedParameters, DefaultValues, sizeof(uint16_t) * Parameter::COUNT);
 
             if (Storage::FileExists("DejaVu/settings.bin"))
             {
@@ -242,8 +373,6 @@ namespace DejaVu
                 Storage::ReadFile("DejaVu/settings.bin", (uint8_t*)storedParameters, sizeof(uint16_t) * Parameter::COUNT);
                 LogInfo("Done reading settings");
             }
-            else
-                memcpy(storedParameters, DefaultValues, sizeof(uint16_t) * Parameter::COUNT);
             
             for (size_t i = 0; i < Parameter::COUNT; i++)
             {
@@ -276,6 +405,19 @@ namespace DejaVu
         }
 
     public:
+        static DejaVuEffect* Instance;
+
+        // Called from the sketch's loop() after the I/O scheduler, so the LEDs follow the transport at loop rate
+        // rather than when the display next redraws. Transport commands are applied by the audio callback
+        static void Service()
+        {
+            if (Instance == nullptr)
+                return;
+            if (Instance->controller.ServiceTransport())
+                Instance->SetLeds();
+            if (Instance->controller.TakeLoopFullWarning())
+                os.menu.setMessage("Loop memory full!", 2000);
+        }
 
         virtual void Start() override
         {
@@ -287,9 +429,16 @@ namespace DejaVu
             LogInfo("Starting up - waiting for controller signal...")
             os.waitForControllerSignal();
             SetNames();
-            os.PageCount = 1;
+            os.PageCount = 2;
             RegisterEffect();
+            Instance = this;
+            if (!controller.IsBandwidthOk())
+                os.menu.setMessage("SD card too slow!", 3000);
+            else if (controller.GetMaxLoopSamples() < MinLoopSeconds * controller.GetSamplerate())
+                os.menu.setMessage("SD card nearly full!", 3000);
             
         }
     };
+
+    DejaVuEffect* DejaVuEffect::Instance = nullptr;
 }
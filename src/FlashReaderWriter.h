@@ -3,6 +3,12 @@
 #include <stdint.h>
 #include "Polygons.h"
 #include "Utils.h"
+#include "Constants.h"
+#include "Checksum.h"
+#include "SlotCatalog.h"
+#include "StorageFormat.h"
+#include "BlockKernels.h"
+#include "LevelMeter.h"
 
 using namespace Polygons;
 
@@ -16,18 +22,140 @@ enum class RecordingMode
 
 const char* BaseFilePath = "DejaVu/RecordingBuffer.dat";
 
-class FlashReaderWriter
+// Storage geometry is derived from the sample rate rather than fixed.
+// Blocks are the largest power of two lasting at most StorageBlockMaxMs, bounded by StorageBlockMaxSize to keep RAM in check.
+// When the sample rate goes up and the block can't grow with it, more blocks are read ahead instead, so the time
+// budget for the SD card to answer a read stays at least SdWorstCaseLatencyMs.
+const static int StorageBlockMaxMs = 100;
+const static int StorageBlockMaxSize = 4096;
+const static int SdWorstCaseLatencyMs = 80;
+
+// The buffer files are sized from the free space on the card at boot, up to MaxLoopSeconds. The free space is split
+// into equal shares, one per buffer file plus StorageReserveShares that are left for saved slots.
+// Below MinLoopSeconds the user is warned. The block map, checks and envelope cost 10 bytes of RAM per block of
+// capacity, so above MaxLoopSecondsRate the limit shrinks in proportion and they take no more RAM at FS_MAX than at 48 kHz
+const static int MaxLoopSeconds = 720;
+const static int MaxLoopSecondsRate = 48000;
+const static int MinLoopSeconds = 30;
+const static int StorageReserveShares = 2;
+
+// Blocks whose new content stays below this level are stored as silence, and overdub passes that add nothing below it
+// leave the stored block alone. -96 dBFS is half a step of 16 bit storage, so the gate costs nothing there
+const static float DefaultSilenceGate = 0.0000158f;
+
+// Cue points cache their block from the cue on, in a shared cache of CueCacheBlocks blocks. Cues in the first two
+// blocks use the loop start blocks kept in RAM anyway, and the other tails average half a block
+const static int MaxCuePoints = 8;
+const static int CueCacheBlocks = MaxCuePoints / 2 + 1;
+
+constexpr int StorageBlockSizeFor(int samplerate, int size = BUFFER_SIZE)
+{
+    return (size * 2 <= StorageBlockMaxSize && (long long)size * 2 * 1000 <= (long long)samplerate * StorageBlockMaxMs)
+        ? StorageBlockSizeFor(samplerate, size * 2)
+        : size;
+}
+
+constexpr int ReadAheadBlocksFor(int samplerate, int blockSize)
+{
+    return 1 + (int)(((long long)SdWorstCaseLatencyMs * samplerate + 1000LL * blockSize - 1) / (1000LL * blockSize));
+}
+
+// Set whenever an audio callback queues a flash operation, so the I/O scheduler can wake up instead of sleeping on a timer
+volatile bool FlashOpsSubmitted = false;
+
+// Counters for diagnosing how well the card keeps up with the audio path
+struct FlashDiagnostics
+{
+    uint32_t ReadMisses = 0; // a block became current before its read completed, silence was played instead
+    uint32_t WriteOverruns = 0; // a write slot was reused before its data reached the card
+    uint32_t DeadlineMisses = 0; // an operation completed after its deadline
+    uint32_t MaxReadLatencyUs = 0; // worst time from submission to completion
+    uint32_t MaxWriteLatencyUs = 0;
+    uint32_t SkippedWrites = 0; // overdubbed blocks that stayed unchanged, nothing was written
+    uint32_t SparseWrites = 0; // silent blocks that were marked in the block map instead of written
+    uint32_t ChecksumErrors = 0; // a block read back differently than it was written, silence was used instead
+};
+
+// Result of timing a burst of block reads and writes against the buffer file
+struct StorageThroughput
+{
+    int Blocks = 0;
+    int BlockBytes = 0;
+    uint32_t ReadUs = 0;
+    uint32_t WriteUs = 0;
+    uint32_t WorstReadUs = 0;
+    uint32_t WorstWriteUs = 0;
+
+    // Checks whether the card can keep up with overdubbing (one read and one write per block and stream) for the given geometry.
+    // The average I/O may use at most half the block period, and the worst case single op must fit in the read ahead window.
+    inline bool IsSustainable(int samplerate, int blockSize, int readAheadBlocks, int streams, int frameBytes = sizeof(float)) const
+    {
+        if (Blocks == 0 || BlockBytes == 0)
+            return false;
+
+        double scale = (double)blockSize * frameBytes / BlockBytes;
+        double avgReadUs = ReadUs * scale / Blocks;
+        double avgWriteUs = WriteUs * scale / Blocks;
+        double worstUs = (WorstReadUs > WorstWriteUs ? WorstReadUs : WorstWriteUs) * scale;
+        double blockPeriodUs = blockSize * 1000000.0 / samplerate;
+
+        bool bandwidthOk = streams * (avgReadUs + avgWriteUs) <= blockPeriodUs * 0.5;
+        bool latencyOk = worstUs <= blockPeriodUs * (readAheadBlocks - 1);
+        return bandwidthOk && latencyOk;
+    }
+};
+
+// Interface the I/O scheduler uses to service channels regardless of their storage configuration
+class FlashChannel
+{
+public:
+    virtual ~FlashChannel() = default;
+    virtual bool PeekNextOperation(uint32_t* deadlineUs, bool* isRead) = 0;
+    virtual bool ProcessNextOperation() = 0;
+};
+
+// Streams a loop to and from the SD card.
+// BlockSize is the number of frames per storage block, Channels the number of interleaved channels per frame, and
+// SampleT the sample type stored on the card. All of them are compile time constants, so the block loops have fixed
+// trip counts and the storage conversion is resolved at compile time. The audio path always works on float.
+template <int BlockSize = StorageBlockSizeFor(SAMPLERATE), int Channels = 1, typename SampleT = float>
+class FlashReaderWriterT : public FlashChannel
 {
     SdFat sd;
     SdFile file;
 
-    const static int StorageBufferSize = 4096; // must be multiple of the BUFFER_SIZE
-
+    const static int StorageBufferSize = BlockSize; // frames per block, must be multiple of the BUFFER_SIZE
+    const static int BlockSamples = BlockSize * Channels; // interleaved samples per block in RAM
+    const static int FrameBytes = Channels * sizeof(SampleT);
+    const static int BlockBytes = BlockSize * FrameBytes; // bytes per block on the card
+    const static int ReadAheadBlocks = ReadAheadBlocksFor(SAMPLERATE, StorageBufferSize);
+    const static int MaxMappedBlocks = 0x7FFE; // physical block numbers must stay clear of the flags in BlockRef
+    const static int MaxLoopRate = SAMPLERATE < MaxLoopSecondsRate ? SAMPLERATE : MaxLoopSecondsRate;
+    const static int MaxLoopBlocks = (int)(((long long)MaxLoopSeconds * MaxLoopRate + StorageBufferSize - 1) / StorageBufferSize);
+    const static int MaxCapacityBlocks = MaxLoopBlocks < MaxMappedBlocks ? MaxLoopBlocks : MaxMappedBlocks;
+    static_assert((long long)MaxCapacityBlocks * BlockBytes < 0x7FFFFFFFLL, "Buffer file offsets must fit in an int");
+    static_assert(BlockSize <= 0x7FFF, "Block length must fit in BlockRef::Frames");
+    static_assert(StorageBufferSize % BUFFER_SIZE == 0, "StorageBufferSize must be a multiple of BUFFER_SIZE");
+    const static uint32_t BlockPeriodUs = (uint32_t)((long long)StorageBufferSize * 1000000 / SAMPLERATE);
+    const static int SlotHeaderSize = 2 * sizeof(int);
+    // Slot files end with a trailer: a 16 bit check per block, the level of each block, the checksum of the whole slot,
+    // then SlotTrailerMagic. It sits behind the blocks so slots saved before it existed still load, they are just not
+    // verified. Trailers of SlotTrailerMagicV1 carry no levels
+    const static uint32_t SlotTrailerMagic = 0x32434456; // "VDC2"
+    const static uint32_t SlotTrailerMagicV1 = 0x4B434456; // "VDCK"
+
+    StorageCodec<SampleT, BlockSamples> Codec;
+
+    // All indices into the loop (FlashIdx, FlashIdxRead, FlashIdxWrite, BufReadIdx) are logical block numbers
     struct FlashReadOp
     {
         int FlashIdx = 0;
         bool Pending = false;
         int OperationId = 0;
+        int Slot = 0; // destination slot in the read ring
+        int Generation = 0; // reads queued before the last play / cue jump are stale and get dropped
+        uint32_t SubmitUs = 0;
+        uint32_t DeadlineUs = 0; // when the audio callback will need the data
     };
 
     struct FlashWriteOp
@@ -35,53 +163,156 @@ class FlashReaderWriter
         int FlashIdx = 0;
         bool Pending = false;
         int OperationId = 0;
-        float Data[StorageBufferSize] = {0};
+        uint32_t SubmitUs = 0;
+        uint32_t DeadlineUs = 0; // when the slot will be reused by the audio callback
+        bool Silent = false; // Data is all zeros, the block is marked silent rather than written
+        BlockLevel Level; // taken while Data was filled, becomes the block's entry in the envelope
+        float Data[BlockSamples] = {0};
     };
 
      // circular buffer for operations processed async
-    const static int OpBufferSize = 3;
+    const static int OpBufferSize = ReadAheadBlocks + 1;
+    const static int ReadOpBufferSize = 2 * OpBufferSize; // room for a full set of stale reads after a jump
     FlashWriteOp WriteOps[OpBufferSize];
-    FlashReadOp ReadOps[OpBufferSize];
+    FlashReadOp ReadOps[ReadOpBufferSize];
     int ReadOpsHead = 0;
     int ReadOpsTail = 0;
     int WriteOpsHead = 0;
     int WriteOpsTail = 0;
     int OperationId = 0;
+    FlashDiagnostics Diagnostics;
 
     char BufferFileName[64];
     char SaveFileName[70];
 
+    // The slot index answers "is this slot populated, how long is it" without touching the slot files.
+    // The first blocks of the most recently used slots are kept in RAM, so a load can start without reading them back.
+    const static int SlotHeadCacheSize = 2;
+    struct SlotHead
+    {
+        int Slot = 0;
+        uint32_t LastUsed = 0;
+        float* Data = nullptr; // 2 * BlockSamples samples, heap allocated in Init
+    };
+    SlotCatalog Catalog;
+    SlotHead SlotHeads[SlotHeadCacheSize];
+    uint32_t SlotHeadUseCounter = 0;
+
+    // When a slot is loaded in streaming mode, the working loop reads straight from the slot file.
+    // A block is only copied into the buffer file when it is first written (overdubbed).
+    SdFile streamFile;
+    int StreamSlot = 0;
+
+    // Blocks preallocated in the buffer file. The file is contiguous, so seeking to any block costs the same
+    int CapacityBlocks = 0;
+
+    // Logical blocks of the loop map to physical blocks of the buffer file, to blocks of the streamed slot file, or to
+    // silence. After a multiply, several logical blocks share one physical block. Writing to a shared block moves it to
+    // a fresh physical block, which costs nothing extra since every write replaces the whole block.
+    // Only the loop context (I/O and UI) modifies the map. The audio callback only reads the block lengths; when it
+    // starts or closes a recording it changes the loop length and leaves the map upkeep to the I/O side.
+    const static uint16_t SilentBlock = 0xFFFF;
+    const static uint16_t SlotBlockFlag = 0x8000;
+    struct BlockRef
+    {
+        uint32_t Block : 16; // physical block in the buffer file, SlotBlockFlag | block in the slot file, or SilentBlock
+        uint32_t Frames : 15; // loop frames held by the block, less than the block size only where a segment ends
+        uint32_t Owned : 1; // no other logical block refers to the physical block, so it can be written in place
+    };
+    BlockRef* BlockMap = nullptr; // CapacityBlocks entries, heap allocated in Init
+    uint32_t* PhysicalUsed = nullptr; // one bit per physical block, rebuilt from the map when the allocator runs out
+    uint32_t* PhysicalShared = nullptr; // scratch for the rebuild, shares the allocation of PhysicalUsed
+    int AllocCursor = 0;
+    int LogicalBlocks = 0;
+
+    // A 16 bit check per block, taken from the encoded bytes as they are written and compared when they are read back.
+    // BlockChecks follows the physical blocks of the buffer file, SlotChecks the blocks of the streamed slot file
+    uint16_t* BlockChecks = nullptr; // CapacityBlocks entries each, heap allocated in Init, both null if that failed
+    uint16_t* SlotChecks = nullptr;
+    bool SlotChecksValid = false;
+
+    // Loudness envelope of the loop, one entry per logical block, so the loop can be drawn and normalised without
+    // reading it back. Levels come from the write kernels and are stored with saved slots. A slot saved without them
+    // leaves the envelope unknown until the next recording
+    BlockLevel* Envelope = nullptr; // CapacityBlocks entries, heap allocated in Init
+    bool EnvelopeValid = true;
+    volatile bool MapResetPending = false;
+    volatile bool MapLengthPending = false;
+
     // These buffers store the data from the first block in flash.
     // We do this because when the loop comes around, we need this data very quickly, and we don't have time to load it from flash
-    float BufLoopStart0[StorageBufferSize] = {0};
-    float BufLoopStart1[StorageBufferSize] = {0};
-
-    float BufWrite[StorageBufferSize] = {0};
-    float BufRead[StorageBufferSize] = {0};
-    float BufReadNext[StorageBufferSize] = {0};
-    float BufReadNextNext[StorageBufferSize] = {0};
-    
+    float BufLoopStart0[BlockSamples] = {0};
+    float BufLoopStart1[BlockSamples] = {0};
+
+    float BufWrite[BlockSamples] = {0};
+
+    // Ring of read blocks. The current block is played from BufRead, the following ReadAheadBlocks slots are being filled
+    const static int ReadRingSize = ReadAheadBlocks + 1;
+    float BufReadRing[ReadRingSize][BlockSamples] = {{0}};
+    int BufReadRingIdx[ReadRingSize] = {0};
+    int ReadRingPos = 0;
+    bool BufReadRingPending[ReadRingSize] = {0};
+    float* BufRead = BufReadRing[0];
     int BufReadIdx = 0;
-    int BufReadNextIdx = 0;
-    int BufReadNextNextIdx = 0;
+    int ReadGeneration = 0;
+
+    // Cue points, in frames from the loop start. The block containing each cue point is kept in RAM from the cue on,
+    // so playback can jump to any cue at the next block boundary without waiting for the card
+    int CuePoints[MaxCuePoints] = {0};
+    int CueCacheIdx[MaxCuePoints] = {0};
+    int CueBlockStart[MaxCuePoints] = {0}; // loop frame at which the cached block starts
+    int CueCacheStart[MaxCuePoints] = {0}; // first frame of the block held in the cache
+    float* CueData[MaxCuePoints] = {nullptr}; // the cached frames, in CueCache or the loop start blocks
+    volatile int CueCount = 0;
+    float* CueCache = nullptr; // CueCacheBlocks * BlockSamples samples, heap allocated in Init
+    volatile int PendingCue = -1;
 
     int BufIdx = 0;
     int BufIdxTotal = 0;
+    int CurrentBlockFrames = BlockSize; // frames of the block being played or recorded
     int FlashIdxRead = 0;
     int FlashIdxWrite = 0;
     int TotalLength = 0;
-    int TotalStorageArea = 0;
     RecordingMode Mode = RecordingMode::Stopped;
+    // derived from Mode when it changes rather than on every callback, which matters with small audio blocks
+    bool ReadActive = false;
+    bool WriteActive = false;
+    bool OverdubActive = false;
+    float OverdubFeedback = 1.0f; // how much of the existing loop survives each overdub pass
+    float SilenceGate = DefaultSilenceGate;
+    float BlockInputPeak = 0.0f; // peaks of the input written and the loop played in the current block so far
+    float BlockReadPeak = 0.0f;
 
 public:
 
-    inline FlashReaderWriter(const char* fileSuffix = "")
+    inline FlashReaderWriterT(const char* fileSuffix = "")
     {
         strcpy(BufferFileName, BaseFilePath);
         strcat(BufferFileName, fileSuffix);
+        Catalog.SetFileName(BufferFileName);
         LogInfof("Buffer file: %s", BufferFileName)
     }
 
+    inline ~FlashReaderWriterT()
+    {
+        // instances are created and destroyed per configuration by the benchmark, the card only has so many handles
+        streamFile.close();
+        file.close();
+        for (int i = 0; i < SlotHeadCacheSize; i++)
+            free(SlotHeads[i].Data);
+        free(CueCache);
+        free(BlockMap);
+        free(PhysicalUsed);
+        free(BlockChecks);
+        free(SlotChecks);
+        free(Envelope);
+    }
+
+    inline const SlotInfo* GetSlotInfo(int slot)
+    {
+        return Catalog.Get(slot);
+    }
+
     inline void SetRecordingFile(int slot)
     {
         strcpy(SaveFileName, BufferFileName);
@@ -89,9 +320,17 @@ public:
         LogInfof("Loading/Storing to file: %s", SaveFileName);
     }
 
-    inline void SaveRecording(int slot)
+    // gain scales the saved copy, for normalising; the working loop is left as it is
+    inline void SaveRecording(int slot, int bpm = 0, float gain = 1.0f)
     {
         AudioDisable();
+        // writes still queued must reach the card before it is read back
+        ProcessFlashOperations();
+
+        // we're about to truncate the file we are streaming from, pull the remaining blocks into the buffer file first
+        if (slot == StreamSlot)
+            MaterialiseStreamFile();
+
         SetRecordingFile(slot);
         SdFile saveFile;
         if (!saveFile.open(SaveFileName, O_RDWR | O_CREAT | O_TRUNC))
@@ -99,46 +338,138 @@ public:
         else
             LogInfo("SaveFile created")
 
+        // slot files hold the loop in whole blocks, so blocks that end early after a multiply are packed back together
+        int storageArea = (TotalLength + StorageBufferSize - 1) / StorageBufferSize * StorageBufferSize;
         saveFile.write((uint8_t*)&TotalLength, sizeof(int));
-        saveFile.write((uint8_t*)&TotalStorageArea, sizeof(int));
-        LogInfof("Written length and storage info: %d :: %d", TotalLength, TotalStorageArea)
-        float buf[StorageBufferSize];
+        saveFile.write((uint8_t*)&storageArea, sizeof(int));
+        LogInfof("Written length and storage info: %d :: %d", TotalLength, storageArea)
+        float buf[BlockSamples];
+        float packed[BlockSamples];
+        int packedFrames = 0;
+        Checksum checksum;
 
         int i = 0;
-        int chunkCount = TotalStorageArea / StorageBufferSize;
-        file.seek(0);
-        while(i < chunkCount)
+        int chunkCount = storageArea / StorageBufferSize;
+        int savedChunks = 0;
+        uint16_t* checks = (uint16_t*)malloc(chunkCount * (sizeof(uint16_t) + sizeof(BlockLevel)));
+        BlockLevel* levels = checks != nullptr ? (BlockLevel*)&checks[chunkCount] : nullptr;
+        if (checks == nullptr)
+            LogWarn("Unable to allocate block checks, the slot is saved without them")
+        float packedPeak = 0.0f;
+        float packedSquares = 0.0f;
+        while (i < LogicalBlocks)
         {
-            int result = file.read((uint8_t*)buf, StorageBufferSize * 4);
+            int result = ReadStoredBlock(i, buf);
             if (result <= 0)
             {
                 LogInfo("Exiting file save operation")
                 break;
             }
-            saveFile.write((uint8_t*)buf, StorageBufferSize * 4);
+
+            int frames = BlockFrames(i);
+            int done = 0;
+            while (done < frames)
+            {
+                int count = frames - done < StorageBufferSize - packedFrames ? frames - done : StorageBufferSize - packedFrames;
+                float peak = CopyGainLevel(&packed[packedFrames * Channels], &buf[done * Channels], count * Channels, gain, &packedSquares);
+                packedPeak = peak > packedPeak ? peak : packedPeak;
+                packedFrames += count;
+                done += count;
+                if (packedFrames == StorageBufferSize)
+                {
+                    auto raw = Codec.Encode(packed);
+                    saveFile.write(raw, BlockBytes);
+                    checksum.Update(raw, BlockBytes);
+                    if (checks != nullptr)
+                    {
+                        checks[savedChunks] = BlockCheck(raw);
+                        levels[savedChunks] = MakeBlockLevel(packedPeak, packedSquares, BlockSamples);
+                    }
+                    packedPeak = 0.0f;
+                    packedSquares = 0.0f;
+                    packedFrames = 0;
+                    savedChunks++;
+                    LogInfof("Saved chunk %d of %d", savedChunks, chunkCount)
+                }
+            }
             i++;
-            LogInfof("Saved chunk %d of %d", i, chunkCount)
         }
 
+        if (i == LogicalBlocks && packedFrames > 0)
+        {
+            ZeroBuffer(&packed[packedFrames * Channels], (StorageBufferSize - packedFrames) * Channels);
+            auto raw = Codec.Encode(packed);
+            saveFile.write(raw, BlockBytes);
+            checksum.Update(raw, BlockBytes);
+            if (checks != nullptr)
+            {
+                checks[savedChunks] = BlockCheck(raw);
+                levels[savedChunks] = MakeBlockLevel(packedPeak, packedSquares, BlockSamples);
+            }
+            savedChunks++;
+        }
+
+        if (savedChunks == chunkCount && checks != nullptr)
+        {
+            uint32_t tail[2] = { checksum.Value(), SlotTrailerMagic };
+            saveFile.write((uint8_t*)checks, chunkCount * (sizeof(uint16_t) + sizeof(BlockLevel)));
+            saveFile.write((uint8_t*)tail, sizeof(tail));
+        }
+        free(checks);
         saveFile.close();
 
-        if (i == chunkCount)
+        if (savedChunks == chunkCount)
+        {
+            SlotInfo info;
+            info.TotalLength = TotalLength;
+            info.TotalStorageArea = storageArea;
+            info.Format = SampleTraits<SampleT>::Format;
+            info.Bpm = bpm;
+            info.Checksum = checksum.Value();
+            Catalog.Update(slot, info);
+            // the loop start blocks are the first two saved blocks unless packing moved them or they were scaled
+            if (gain == 1.0f && BlockFrames(0) == StorageBufferSize && (LogicalBlocks <= 2 || BlockFrames(1) == StorageBufferSize))
+                StoreSlotHead(slot, BufLoopStart0, BufLoopStart1);
+            else
+                DropSlotHead(slot);
             LogInfof("Successfully saved content in slot %d", slot)
+        }
 
         AudioEnable();
     }
 
-    inline int LoadRecording(int slot)
+    // Loads a slot. In streaming mode, playback starts from the cached slot head and the rest of the loop is read
+    // straight from the slot file; otherwise the whole slot is copied into the buffer file before playback starts.
+    inline int LoadRecording(int slot, bool streamed = true)
     {
+        auto slotInfo = Catalog.Get(slot);
+        if (slotInfo == nullptr || !slotInfo->IsPopulated())
+            return 1;
+
+        if (slotInfo->Format != SampleTraits<SampleT>::Format)
+        {
+            LogErrorf("Slot %d was stored in format %d, cannot load it", slot, (int)slotInfo->Format)
+            return 2;
+        }
+
+        if (slotInfo->TotalStorageArea > GetMaxLength())
+        {
+            LogErrorf("Slot %d holds %d samples, the buffer file only fits %d", slot, (int)slotInfo->TotalStorageArea, GetMaxLength())
+            return 2;
+        }
+
+        if (streamed)
+            return StreamRecording(slot, slotInfo);
+
         AudioDisable();
+        ServiceMap();
+        DetachStreamFile();
         SetRecordingFile(slot);
         SdFile saveFile;
-        if (!sd.exists(SaveFileName))
-            return 1;
-
         if (!saveFile.open(SaveFileName, O_RDONLY))
         {
             LogError("Failed to open save file")
+            AudioEnable();
             return 2;
         }
         else
@@ -148,306 +479,1589 @@ public:
         saveFile.read((uint8_t*)&readTotalLen, sizeof(int));
         saveFile.read((uint8_t*)&readTotalStorageArea, sizeof(int));
         LogInfof("Read length and storage info: %d :: %d", readTotalLen, readTotalStorageArea)
-        float buf[StorageBufferSize];
+        uint8_t buf[BlockBytes]; // copied as stored, no conversion needed
 
+        ResetBlockMap();
+        SetTotalLength(readTotalLen);
+        ServiceMap();
         int i = 0;
         int chunkCount = readTotalStorageArea / StorageBufferSize;
-        file.seek(0);
+        // SlotChecks is free while nothing is streamed, it holds the checks of the slot being copied
+        EnvelopeValid = false;
+        bool verify = SlotChecks != nullptr && ReadSlotTrailer(saveFile, chunkCount, SlotChecks, chunkCount, nullptr, Envelope);
+        saveFile.seek(SlotHeaderSize);
+        Checksum checksum;
         while(i < chunkCount)
         {
-            int result = saveFile.read((uint8_t*)buf, StorageBufferSize * 4);
+            int result = saveFile.read((uint8_t*)buf, BlockBytes);
             if (result <= 0)
             {
                 LogInfo("Exiting file load operation")
+                saveFile.close();
+                AudioEnable();
+                return 2;
+            }
+            if (!verify)
+                checksum.Update(buf, BlockBytes);
+            uint16_t check = BlockCheck(buf);
+            if (verify && check != SlotChecks[i])
+            {
+                // the block stays silent rather than loading noise into the loop
+                LogWarnf("Chunk %d of slot %d is corrupt, loading silence instead", i, slot)
+                Diagnostics.ChecksumErrors++;
+                if (Envelope != nullptr)
+                    Envelope[i] = BlockLevel();
+                i++;
+                continue;
+            }
+
+            int physical = PhysicalForWrite(i);
+            if (physical < 0)
+            {
+                LogInfo("Exiting file load operation")
+                saveFile.close();
+                AudioEnable();
                 return 2;
             }
-            file.write((uint8_t*)buf, StorageBufferSize * 4);
+            file.seek(physical * BlockBytes);
+            file.write((uint8_t*)buf, BlockBytes);
+            if (BlockChecks != nullptr)
+                BlockChecks[physical] = check;
             i++;
             LogInfof("Loaded chunk %d of %d", i, chunkCount)
         }
 
-        file.seek(0);
-        file.read((uint8_t*)BufLoopStart0, StorageBufferSize * 4);
-        file.read((uint8_t*)BufLoopStart1, StorageBufferSize * 4);
-        file.seek(0);
+        // slots saved without a trailer can only be checked as a whole
+        if (!verify && slotInfo->Checksum != 0 && checksum.Value() != slotInfo->Checksum)
+        {
+            LogWarnf("Slot %d does not match its checksum", slot)
+            Diagnostics.ChecksumErrors++;
+        }
+
+        if (!LoadSlotHead(slot, BufLoopStart0, BufLoopStart1))
+        {
+            ReadStoredBlock(0, BufLoopStart0);
+            ReadStoredBlock(1, BufLoopStart1);
+            StoreSlotHead(slot, BufLoopStart0, BufLoopStart1);
+        }
 
         saveFile.close();
 
         if (i == chunkCount)
             LogInfof("Successfully loaded content from slot %d", slot)
 
-        TotalLength = readTotalLen;
-        TotalStorageArea = readTotalStorageArea;
         PreparePlay();
         AudioEnable();
         return 0;
     }
 
-    void SetFixedLength(int sampleCount)
+    inline int StreamRecording(int slot, const SlotInfo* slotInfo)
     {
-        LogInfof("Setting fixed length of %d samples", sampleCount)
         AudioDisable();
-        SetTotalLength(sampleCount);
-        float buf[StorageBufferSize];
-        ZeroBuffer(buf, StorageBufferSize);
+        ServiceMap();
+        DetachStreamFile();
+        SetRecordingFile(slot);
+        if (!streamFile.open(SaveFileName, O_RDONLY))
+        {
+            LogError("Failed to open save file")
+            AudioEnable();
+            return 2;
+        }
 
-        int i = 0;
-        int chunkCount = TotalStorageArea / StorageBufferSize;
-        file.seek(0);
-        while(i < chunkCount)
+        // every block refers to the slot file until it is overdubbed, the loop start blocks are written back on the
+        // first overdub pass like any other block
+        StreamSlot = slot;
+        ResetBlockMap();
+        SetTotalLength(slotInfo->TotalLength);
+        ServiceMap();
+        for (int i = 0; i < LogicalBlocks; i++)
+            BlockMap[i].Block = SlotBlockFlag | i;
+
+        int chunkCount = slotInfo->TotalStorageArea / StorageBufferSize;
+        EnvelopeValid = false;
+        SlotChecksValid = SlotChecks != nullptr && ReadSlotTrailer(streamFile, chunkCount, SlotChecks, chunkCount, nullptr, Envelope);
+        if (!SlotChecksValid)
+            LogInfof("Slot %d has no block checks, streaming it unverified", slot)
+
+        if (!LoadSlotHead(slot, BufLoopStart0, BufLoopStart1))
         {
-            file.write((uint8_t*)buf, StorageBufferSize * 4);
-            i++;
-            LogInfof("Zeroed chunk %d of %d", i, chunkCount)
+            ReadStoredBlock(0, BufLoopStart0);
+            if (LogicalBlocks > 1)
+                ReadStoredBlock(1, BufLoopStart1);
+            else
+                ZeroBuffer(BufLoopStart1, BlockSamples);
+            StoreSlotHead(slot, BufLoopStart0, BufLoopStart1);
         }
 
-        file.seek(0);
-        ZeroBuffer(BufLoopStart0, StorageBufferSize);
-        ZeroBuffer(BufLoopStart1, StorageBufferSize);
         PreparePlay();
         AudioEnable();
+        LogInfof("Streaming content from slot %d", slot)
+        return 0;
     }
 
-    inline void Init()
+    // Stops reading from the slot file. The caller is responsible for the block map no longer referring to it
+    inline void DetachStreamFile()
     {
-        LogInfo("-------------------------------------------")
-        LogInfo(BufferFileName)
+        if (StreamSlot == 0)
+            return;
 
-        if (!sd.begin(P_SPI_SD_CS, 60000000))
-        {
-            sd.initErrorHalt(&Serial);
-            LogError("Unable to initialise SD Card!")
-        }
-        LogInfo("SD Card initialization done.")
-        
-        bool initFile = true;
-        sd.mkdir("DejaVu");
+        streamFile.close();
+        StreamSlot = 0;
+        SlotChecksValid = false;
+        LogInfo("Detached from slot file")
+    }
 
-        if (!file.open(BufferFileName, O_RDWR | O_CREAT | O_TRUNC))
-            LogError("Failed to open buffer file")
-        else
-            LogInfo("Bufferfile created")
+    // Copies all blocks still living in the slot file into the buffer file, then detaches
+    inline void MaterialiseStreamFile()
+    {
+        if (StreamSlot == 0)
+            return;
 
-        if (initFile)
+        float buf[BlockSamples];
+        for (int block = 0; block < LogicalBlocks; block++)
         {
-            LogInfo("About to allocate...")
-            bool allocResult = file.preAllocate(17280000);
-            file.seek(0);
-            auto size = file.size();
-            LogInfof("Allocation result: %s -- new file size: %d", allocResult ? "true" : "false", size)
+            if (!(BlockMap[block].Block & SlotBlockFlag) || BlockMap[block].Block == SilentBlock)
+                continue;
+            ReadStoredBlock(block, buf);
+            WriteStoredBlock(block, buf);
         }
-        LogInfo("Flash buffer ready")
+        DetachStreamFile();
+    }
 
-        WriteOps[0].Pending = false;
-        WriteOps[1].Pending = false;
-        ReadOps[0].Pending = false;
-        ReadOps[1].Pending = false;
+    inline BlockRef MakeBlockRef(int block, int frames, bool owned)
+    {
+        BlockRef ref;
+        ref.Block = block;
+        ref.Frames = frames;
+        ref.Owned = owned ? 1 : 0;
+        return ref;
     }
 
-    inline void SetMode(RecordingMode mode)
+    // Empties the map, every block reads as silence and the buffer file is free to be laid out from the start
+    inline void ResetBlockMap()
     {
-        Mode = mode;
+        if (BlockMap == nullptr)
+            return;
+
+        for (int i = 0; i < CapacityBlocks; i++)
+            BlockMap[i] = MakeBlockRef(SilentBlock, StorageBufferSize, false);
+        memset(PhysicalUsed, 0, (CapacityBlocks + 31) / 32 * sizeof(uint32_t));
+        AllocCursor = 0;
+        for (int i = 0; Envelope != nullptr && i < CapacityBlocks; i++)
+            Envelope[i] = BlockLevel();
+        EnvelopeValid = true;
     }
 
-    inline RecordingMode GetMode()
+    // Finds a free physical block past the cursor, or returns -1 once the cursor reaches the end of the file
+    inline int AllocatePhysical()
     {
-        return Mode;
+        for (; AllocCursor < CapacityBlocks; AllocCursor++)
+        {
+            uint32_t bit = 1u << (AllocCursor & 31);
+            if (PhysicalUsed[AllocCursor >> 5] & bit)
+                continue;
+            PhysicalUsed[AllocCursor >> 5] |= bit;
+            return AllocCursor++;
+        }
+        return -1;
     }
 
-    inline void SetTotalLength(int len)
+    // Blocks released by copy on write are only found again here, by rebuilding the used set from the map. Blocks
+    // that are no longer shared get ownership back, so they are written in place again
+    inline void CollectPhysical()
     {
-        TotalLength = len;
-        
-        // figure out how many storage buffers are needed to store TotalLength samples
-        TotalStorageArea = (TotalLength / StorageBufferSize) * StorageBufferSize;
-        if (TotalLength % StorageBufferSize > 0)
-            TotalStorageArea += StorageBufferSize;
+        int words = (CapacityBlocks + 31) / 32;
+        memset(PhysicalUsed, 0, words * sizeof(uint32_t));
+        memset(PhysicalShared, 0, words * sizeof(uint32_t));
+        for (int i = 0; i < CapacityBlocks; i++)
+        {
+            int physical = BlockMap[i].Block;
+            if (physical == SilentBlock || (physical & SlotBlockFlag))
+                continue;
+            uint32_t bit = 1u << (physical & 31);
+            if (PhysicalUsed[physical >> 5] & bit)
+                PhysicalShared[physical >> 5] |= bit;
+            PhysicalUsed[physical >> 5] |= bit;
+        }
 
-        LogDebugf("Setting TotalLength to: %d :: %d", TotalLength, TotalStorageArea)
+        for (int i = 0; i < CapacityBlocks; i++)
+        {
+            int physical = BlockMap[i].Block;
+            if (physical != SilentBlock && !(physical & SlotBlockFlag))
+                BlockMap[i].Owned = (PhysicalShared[physical >> 5] & (1u << (physical & 31))) ? 0 : 1;
+        }
+        AllocCursor = 0;
+        LogDebug("Rebuilt the set of used physical blocks")
     }
 
-    inline void PreparePlay()
+    // The physical block a write to the given logical block goes to. Shared, silent and streamed blocks get a block
+    // of their own. The allocation only fails if the loop is longer than the buffer file
+    inline int PhysicalForWrite(int block)
     {
-        LogDebug("Preparing play...")
-        // We load the BufLoopStart into the queued buffer, and then invoke AdvanceRead which copies it into the main buffer
-        Copy(BufReadNext, BufLoopStart0, StorageBufferSize);
-        Copy(BufReadNextNext, BufLoopStart1, StorageBufferSize);
-        BufReadNextIdx = 0;
-        BufReadNextNextIdx = StorageBufferSize;
-        FlashIdxRead = 2 * StorageBufferSize;
-        FlashIdxWrite = 0;
-        BufIdx = 0;
-        BufIdxTotal = 0;
-        AdvanceRead();
+        if (block < 0 || block >= CapacityBlocks)
+            return -1;
+        if (BlockMap[block].Owned)
+            return BlockMap[block].Block;
+
+        int physical = AllocatePhysical();
+        if (physical < 0)
+        {
+            CollectPhysical();
+            if (BlockMap[block].Owned)
+                return BlockMap[block].Block;
+            physical = AllocatePhysical();
+            if (physical < 0)
+                return -1;
+        }
+        BlockMap[block].Block = physical;
+        BlockMap[block].Owned = 1;
+        return physical;
     }
 
-    inline void AdvanceRead()
+    // Frames of the loop held by a block. While a loop is being recorded, all blocks are full
+    inline int BlockFrames(int block)
     {
-        LogDebugf("Advance Read with %d samples. OpId %d", BufIdx, OperationId)
+        if (TotalLength == 0 || block < 0 || block >= CapacityBlocks)
+            return StorageBufferSize;
+        return BlockMap[block].Frames;
+    }
 
-        Copy(BufRead, BufReadNext, StorageBufferSize);
-        Copy(BufReadNext, BufReadNextNext, StorageBufferSize);
-        ZeroBuffer(BufReadNextNext, StorageBufferSize);
-        BufReadIdx = BufReadNextIdx;
-        BufReadNextIdx = BufReadNextNextIdx;
+    inline int NextBlock(int block)
+    {
+        return block + 1 >= LogicalBlocks ? 0 : block + 1;
+    }
 
-        if (ReadOps[ReadOpsHead].Pending)
-            LogWarn("While trying to read - operations have not completed!")
-        ReadOps[ReadOpsHead].FlashIdx = FlashIdxRead;
-        ReadOps[ReadOpsHead].OperationId = OperationId;
-        ReadOps[ReadOpsHead].Pending = true;
-        ReadOpsHead = (ReadOpsHead + 1) % OpBufferSize;
-        FlashIdxRead += StorageBufferSize;
-        if (FlashIdxRead >= TotalStorageArea)
-            FlashIdxRead = 0;
+    // Folds the block checksum to 16 bits, which keeps the tables at 2 bytes per block and still catches a torn or
+    // noisy block with near certainty
+    static inline uint16_t BlockCheck(const void* raw)
+    {
+        uint32_t value = Checksum::Of(raw, BlockBytes);
+        return (uint16_t)(value ^ (value >> 16));
+    }
 
-        shouldReadCurrentBuffer = false;
-        OperationId++;
+    // Reads a block, comparing it with its check when one is given. A block that doesn't match is a soft miss:
+    // it is counted and comes back as silence, so a failing card never plays noise bursts
+    inline int ReadBlockFrom(SdFile& source, float* dest, const uint16_t* check = nullptr)
+    {
+        auto raw = Codec.RawTarget(dest);
+        int result = source.read(raw, BlockBytes);
+        if (check != nullptr && result == BlockBytes && BlockCheck(raw) != *check)
+        {
+            LogWarn("Block failed its check, using silence instead")
+            Diagnostics.ChecksumErrors++;
+            ZeroBuffer(dest, BlockSamples);
+            return result;
+        }
+        Codec.Decode(dest);
+        return result;
     }
 
-    inline void AdvanceWrite()
+    inline int WriteBlockTo(SdFile& target, const float* src, uint16_t* check = nullptr)
     {
-        LogDebugf("Advance Write with %d samples. OpId %d", BufIdx, OperationId)
+        auto raw = Codec.Encode(src);
+        if (check != nullptr)
+            *check = BlockCheck(raw);
+        return target.write(raw, BlockBytes);
+    }
 
-        if (WriteOps[WriteOpsHead].Pending)
-            LogWarn("While trying to write - operations have not completed!")
-        WriteOps[WriteOpsHead].FlashIdx = FlashIdxWrite;
-        WriteOps[WriteOpsHead].OperationId = OperationId;
-        WriteOps[WriteOpsHead].Pending = true;
-        if (shouldForceOverdub)
+    // Reads the first checkCount block checks and optionally the slot checksum from the trailer of a slot file with
+    // chunkCount blocks. Returns false when the file has no trailer. When levels is given, the block levels are read
+    // into it, or the envelope is marked unknown if the trailer has none. Leaves the file position behind what was read
+    inline bool ReadSlotTrailer(SdFile& source, int chunkCount, uint16_t* checks, int checkCount, uint32_t* slotChecksum, BlockLevel* levels = nullptr)
+    {
+        uint32_t tail[2];
+        int checksStart = SlotHeaderSize + chunkCount * BlockBytes;
+        int levelsStart = checksStart + chunkCount * sizeof(uint16_t);
+        source.seek(levelsStart + chunkCount * sizeof(BlockLevel));
+        bool hasLevels = source.read((uint8_t*)tail, sizeof(tail)) == sizeof(tail) && tail[1] == SlotTrailerMagic;
+        if (!hasLevels)
         {
-            Mix(BufWrite, BufRead, 1.0, StorageBufferSize);
-            WriteOps[WriteOpsHead].FlashIdx = BufReadIdx;
-            LogDebugf("Overdubbing, using BufReadIdx as flash Index: %d", BufReadIdx)
+            source.seek(levelsStart);
+            if (source.read((uint8_t*)tail, sizeof(tail)) != sizeof(tail) || tail[1] != SlotTrailerMagicV1)
+                tail[1] = 0;
         }
-        Copy(WriteOps[WriteOpsHead].Data, BufWrite, StorageBufferSize);
-        ZeroBuffer(BufWrite, StorageBufferSize);
-        WriteOpsHead = (WriteOpsHead + 1) % OpBufferSize;
-        FlashIdxWrite += StorageBufferSize;
-        if (FlashIdxWrite >= TotalStorageArea && TotalStorageArea != 0)
-            FlashIdxWrite = 0;
 
-        shouldWriteCurrentBuffer = false;
-        shouldForceOverdub = false;
-        OperationId++;
+        if (levels != nullptr)
+        {
+            EnvelopeValid = hasLevels && source.seek(levelsStart)
+                && source.read((uint8_t*)levels, chunkCount * sizeof(BlockLevel)) == (int)(chunkCount * sizeof(BlockLevel));
+        }
+        if (!hasLevels && tail[1] != SlotTrailerMagicV1)
+            return false;
+
+        if (slotChecksum != nullptr)
+            *slotChecksum = tail[0];
+        if (checkCount > chunkCount)
+            checkCount = chunkCount;
+        source.seek(checksStart);
+        return checkCount <= 0 || source.read((uint8_t*)checks, checkCount * sizeof(uint16_t)) == (int)(checkCount * sizeof(uint16_t));
     }
 
-    bool shouldReadCurrentBuffer = false;
-    bool shouldWriteCurrentBuffer = false;
-    bool shouldForceOverdub = false;
-
-    inline void Process(float* input, float* output, int bufSize)
+    // Reads one block of the working loop from wherever it currently lives. Silent blocks never touch the card
+    inline int ReadStoredBlock(int block, float* dest)
     {
-        auto shouldReadNow = Mode == RecordingMode::Playback || Mode == RecordingMode::Overdub;
-        auto shouldWriteNow = Mode == RecordingMode::Recording || Mode == RecordingMode::Overdub;
-        shouldReadCurrentBuffer = shouldReadCurrentBuffer || shouldReadNow;
-        shouldWriteCurrentBuffer = shouldWriteCurrentBuffer || shouldWriteNow;
-        shouldForceOverdub = shouldForceOverdub || Mode == RecordingMode::Overdub;
+        int physical = block >= 0 && block < CapacityBlocks ? (int)BlockMap[block].Block : SilentBlock;
+        if (physical == SilentBlock)
+        {
+            ZeroBuffer(dest, BlockSamples);
+            return BlockBytes;
+        }
 
-        if (BufIdx >= StorageBufferSize || (BufIdxTotal >= TotalLength && TotalLength != 0))
+        if (physical & SlotBlockFlag)
         {
-            if (shouldWriteCurrentBuffer)
-                AdvanceWrite();
+            int slotBlock = physical & ~SlotBlockFlag;
+            streamFile.seek(SlotHeaderSize + slotBlock * BlockBytes);
+            return ReadBlockFrom(streamFile, dest, SlotChecksValid ? &SlotChecks[slotBlock] : nullptr);
+        }
 
-            if (shouldReadCurrentBuffer)
-                AdvanceRead();
+        file.seek(physical * BlockBytes);
+        return ReadBlockFrom(file, dest, BlockChecks != nullptr ? &BlockChecks[physical] : nullptr);
+    }
 
-            if (BufIdxTotal >= TotalLength && TotalLength != 0)
-            {
-                BufIdxTotal = 0;
-            }
-            BufIdx = 0;
+    inline int WriteStoredBlock(int block, const float* src)
+    {
+        int physical = PhysicalForWrite(block);
+        if (physical < 0)
+        {
+            LogWarnf("No storage for block %d, dropping write", block)
+            return 0;
         }
 
-        if (shouldReadNow)
-            Copy(output, &BufRead[BufIdx], bufSize);
+        file.seek(physical * BlockBytes);
+        return WriteBlockTo(file, src, BlockChecks != nullptr ? &BlockChecks[physical] : nullptr);
+    }
 
-        if (shouldWriteNow)
-            Copy(&BufWrite[BufIdx], input, bufSize);
-        else
-            ZeroBuffer(&BufWrite[BufIdx], bufSize);
+    // Turns a block into silence without touching the card. Its physical block is found free again by the next collection
+    inline void ReleaseBlock(int block)
+    {
+        if (block < 0 || block >= CapacityBlocks)
+            return;
+        BlockMap[block].Block = SilentBlock;
+        BlockMap[block].Owned = 0;
+    }
 
-        BufIdx += bufSize;
-        BufIdxTotal += bufSize;
+    // Sets an empty loop of the given length. Nothing is written to the card, unwritten blocks read as silence
+    void SetFixedLength(int sampleCount)
+    {
+        LogInfof("Setting fixed length of %d samples", sampleCount)
+        AudioDisable();
+        ServiceMap();
+        DetachStreamFile();
+        ResetBlockMap();
+        SetTotalLength(sampleCount);
+        ServiceMap();
+        ZeroBuffer(BufLoopStart0, BlockSamples);
+        ZeroBuffer(BufLoopStart1, BlockSamples);
+        PreparePlay();
+        AudioEnable();
     }
 
-    inline void ProcessReadOperation(FlashReadOp* op)
+    // buffersToAllocate is the number of buffer files still to be created on the card, this one included. Each takes
+    // free / (buffersToAllocate + StorageReserveShares), so channels initialised one after the other get equal shares
+    inline void Init(int buffersToAllocate = 1)
     {
-        auto t1 = micros();
-        LogDebugf("Processing Read operation %d. Reading from flashIdx %d", op->OperationId, op->FlashIdx)
+        LogInfo("-------------------------------------------")
+        LogInfo(BufferFileName)
 
-        if (op->FlashIdx >= TotalStorageArea && TotalStorageArea != 0)
+        if (!sd.begin(P_SPI_SD_CS, 60000000))
         {
-            LogWarnf("Trying to read out of bound flash data at Index %d - Aborting Read", op->FlashIdx)
-            op->Pending = false;
-            return;
+            sd.initErrorHalt(&Serial);
+            LogError("Unable to initialise SD Card!")
         }
+        LogInfo("SD Card initialization done.")
+        
+        bool initFile = true;
+        sd.mkdir("DejaVu");
 
-        if (op->FlashIdx == 0)
+        if (!file.open(BufferFileName, O_RDWR | O_CREAT | O_TRUNC))
+            LogError("Failed to open buffer file")
+        else
+            LogInfo("Bufferfile created")
+
+        if (initFile)
         {
-            LogDebug("Reading FlashIdx 0 from RAM")
-            // Cheat and read the data at index 0 from ram, not flash
-            Copy(BufReadNextNext, BufLoopStart0, StorageBufferSize);
+            LogInfo("About to allocate...")
+            CapacityBlocks = AllocateBufferFile(buffersToAllocate);
+            file.seek(0);
+            auto size = file.size();
+            LogInfof("Allocation result: %d blocks (%d seconds) -- new file size: %d", CapacityBlocks, GetMaxLength() / SAMPLERATE, size)
         }
-        else if (op->FlashIdx == StorageBufferSize)
+        LogInfo("Flash buffer ready")
+
+        free(BlockMap);
+        free(PhysicalUsed);
+        int words = (CapacityBlocks + 31) / 32;
+        BlockMap = (BlockRef*)malloc(CapacityBlocks * sizeof(BlockRef));
+        PhysicalUsed = (uint32_t*)malloc(2 * words * sizeof(uint32_t));
+        if (BlockMap == nullptr || PhysicalUsed == nullptr)
         {
-            LogDebug("Reading FlashIdx +1buffer from RAM")
-            // Cheat and read the data at index StorageBufferSize from ram, not flash
-            Copy(BufReadNextNext, BufLoopStart1, StorageBufferSize);
+            LogError("Unable to allocate block map")
+            free(BlockMap);
+            free(PhysicalUsed);
+            BlockMap = nullptr;
+            PhysicalUsed = nullptr;
+            CapacityBlocks = 0;
         }
-        else
+        PhysicalShared = PhysicalUsed != nullptr ? &PhysicalUsed[words] : nullptr;
+        ResetBlockMap();
+
+        free(BlockChecks);
+        free(SlotChecks);
+        BlockChecks = (uint16_t*)malloc(CapacityBlocks * sizeof(uint16_t));
+        SlotChecks = (uint16_t*)malloc(CapacityBlocks * sizeof(uint16_t));
+        if (BlockChecks == nullptr || SlotChecks == nullptr)
         {
-            file.seek(op->FlashIdx * 4);
-            file.read((int8_t*)BufReadNextNext, StorageBufferSize * 4);
+            LogWarn("Unable to allocate block checks, blocks are read back unverified")
+            free(BlockChecks);
+            free(SlotChecks);
+            BlockChecks = nullptr;
+            SlotChecks = nullptr;
         }
-        BufReadNextNextIdx = op->FlashIdx;
-        op->Pending = false;
-        auto t2 = micros();
-        LogDebugf("ProcessReadOp time: %d", (t2-t1))
+
+        free(Envelope);
+        Envelope = (BlockLevel*)calloc(CapacityBlocks, sizeof(BlockLevel));
+        if (Envelope == nullptr)
+            LogWarn("Unable to allocate loop envelope")
+
+        if (!Catalog.Load())
+            RebuildCatalog();
+        InitSlotHeads();
+
+        for (int i = 0; i < OpBufferSize; i++)
+            WriteOps[i].Pending = false;
+        for (int i = 0; i < ReadOpBufferSize; i++)
+            ReadOps[i].Pending = false;
+
+        if (CueCache == nullptr)
+            CueCache = (float*)malloc(CueCacheBlocks * BlockSamples * sizeof(float));
+        if (CueCache == nullptr)
+            LogWarn("Unable to allocate cue cache, cue jumps are disabled")
     }
 
-    inline void ProcessWriteOperation(FlashWriteOp* op)
+    inline int GetBlockSize()
     {
-        auto t1 = micros();
-        LogDebugf("Processing Write operation %d. Writing to flashIdx %d", op->OperationId, op->FlashIdx)
+        return StorageBufferSize;
+    }
 
-        // store the first buffers in RAM for fast access
-        if (op->FlashIdx == 0)
-        {
-            LogDebug("Storing LoopStart0")
-            Copy(BufLoopStart0, op->Data, StorageBufferSize);
-        }
-        if (op->FlashIdx == StorageBufferSize)
-        {
-            LogDebug("Storing LoopStart1")
-            Copy(BufLoopStart1, op->Data, StorageBufferSize);
-        }
-        
-        file.seek(op->FlashIdx * 4);
-        file.write((int8_t*)op->Data, StorageBufferSize * 4);
-        op->Pending = false;
-        auto t2 = micros();
-        LogDebugf("ProcessWriteOp time: %d", (t2-t1))
+    inline int GetReadAheadBlocks()
+    {
+        return ReadAheadBlocks;
     }
 
-    inline void ProcessFlashOperations()
+    // Preallocates the buffer file from the free space on the card. preAllocate needs a contiguous run of clusters,
+    // so on a fragmented card the request is halved until it fits. Returns the number of blocks allocated
+    inline int AllocateBufferFile(int buffersToAllocate)
     {
-        while (ReadOpsHead != ReadOpsTail)
+        if (buffersToAllocate < 1)
+            buffersToAllocate = 1;
+
+        uint64_t freeBytes = (uint64_t)sd.vol()->freeClusterCount() * sd.vol()->bytesPerCluster();
+        uint64_t budget = freeBytes / (buffersToAllocate + StorageReserveShares);
+        int blocks = budget / BlockBytes > (uint64_t)MaxCapacityBlocks ? MaxCapacityBlocks : (int)(budget / BlockBytes);
+        LogInfof("Card has %d MB free, requesting %d blocks", (int)(freeBytes >> 20), blocks)
+
+        while (blocks > ReadRingSize)
         {
-            auto op = &ReadOps[ReadOpsTail];
-            if (op->Pending)
-                ProcessReadOperation(op);
-            
-            ReadOpsTail = (ReadOpsTail + 1) % OpBufferSize;
+            if (file.preAllocate((uint64_t)blocks * BlockBytes))
+                break;
+            LogWarnf("Unable to preallocate %d blocks, retrying with half", blocks)
+            blocks /= 2;
         }
 
-        while (WriteOpsHead != WriteOpsTail)
+        if (blocks <= ReadRingSize)
         {
-            auto op = &WriteOps[WriteOpsTail];
-            if (op->Pending)
-                ProcessWriteOperation(op);
-            
+            LogError("Unable to preallocate the buffer file")
+            return 0;
+        }
+
+        if ((long long)blocks * StorageBufferSize < (long long)MinLoopSeconds * SAMPLERATE)
+            LogWarnf("Buffer file only holds %d seconds, free up space on the SD card", (int)((long long)blocks * StorageBufferSize / SAMPLERATE))
+        return blocks;
+    }
+
+    inline int GetMaxLength()
+    {
+        return CapacityBlocks * StorageBufferSize;
+    }
+
+    inline int GetChannels()
+    {
+        return Channels;
+    }
+
+    inline int GetFrameBytes()
+    {
+        return FrameBytes;
+    }
+
+    // RAM used by this instance, including the heap allocated caches
+    inline int GetRamUsage()
+    {
+        int heap = 0;
+        for (int i = 0; i < SlotHeadCacheSize; i++)
+            heap += SlotHeads[i].Data != nullptr ? 2 * BlockSamples * sizeof(float) : 0;
+        heap += CueCache != nullptr ? CueCacheBlocks * BlockSamples * sizeof(float) : 0;
+        heap += BlockMap != nullptr ? CapacityBlocks * sizeof(BlockRef) + 2 * ((CapacityBlocks + 31) / 32) * sizeof(uint32_t) : 0;
+        heap += BlockChecks != nullptr ? 2 * CapacityBlocks * sizeof(uint16_t) : 0;
+        heap += Envelope != nullptr ? CapacityBlocks * sizeof(BlockLevel) : 0;
+        return sizeof(*this) + heap;
+    }
+
+    // Times a burst of block writes and reads at the start of the buffer file. Only call this while stopped, it overwrites loop data
+    inline StorageThroughput MeasureThroughput(int blocks = 16)
+    {
+        StorageThroughput result;
+        result.Blocks = blocks;
+        result.BlockBytes = BlockBytes;
+        uint8_t buf[BlockBytes];
+        memset(buf, 0, BlockBytes);
+
+        for (int i = 0; i < blocks; i++)
+        {
+            auto t1 = micros();
+            file.seek(i * BlockBytes);
+            file.write((uint8_t*)buf, BlockBytes);
+            auto dt = micros() - t1;
+            result.WriteUs += dt;
+            if (dt > result.WorstWriteUs)
+                result.WorstWriteUs = dt;
+        }
+        file.sync();
+
+        for (int i = 0; i < blocks; i++)
+        {
+            auto t1 = micros();
+            file.seek(i * BlockBytes);
+            file.read((uint8_t*)buf, BlockBytes);
+            auto dt = micros() - t1;
+            result.ReadUs += dt;
+            if (dt > result.WorstReadUs)
+                result.WorstReadUs = dt;
+        }
+
+        file.seek(0);
+        LogInfof("Storage throughput: write %d us/block (worst %d), read %d us/block (worst %d)",
+            (int)(result.WriteUs / blocks), (int)result.WorstWriteUs, (int)(result.ReadUs / blocks), (int)result.WorstReadUs)
+        return result;
+    }
+
+    // Scans the slot file headers once, when no valid index exists on the card (first boot, or card from an older version)
+    inline void RebuildCatalog()
+    {
+        LogInfo("Rebuilding slot index...")
+        Catalog.Clear();
+        for (int slot = 1; slot <= SlotCount; slot++)
+        {
+            SetRecordingFile(slot);
+            SdFile saveFile;
+            if (!sd.exists(SaveFileName) || !saveFile.open(SaveFileName, O_RDONLY))
+                continue;
+
+            SlotInfo info;
+            int r1 = saveFile.read((uint8_t*)&info.TotalLength, sizeof(int));
+            int r2 = saveFile.read((uint8_t*)&info.TotalStorageArea, sizeof(int));
+            if (r1 != sizeof(int) || r2 != sizeof(int))
+            {
+                saveFile.close();
+                continue;
+            }
+            // the trailer knows the slot checksum, slots saved without one stay unknown
+            ReadSlotTrailer(saveFile, info.TotalStorageArea / StorageBufferSize, nullptr, 0, &info.Checksum);
+            saveFile.close();
+
+            info.Format = SampleTraits<SampleT>::Format;
+            info.Sequence = slot;
+            Catalog.Set(slot, info);
+        }
+        Catalog.Store();
+        LogInfo("Slot index rebuilt")
+    }
+
+    inline void InitSlotHeads()
+    {
+        for (int i = 0; i < SlotHeadCacheSize; i++)
+        {
+            if (SlotHeads[i].Data == nullptr)
+                SlotHeads[i].Data = (float*)malloc(2 * BlockSamples * sizeof(float));
+            SlotHeads[i].Slot = 0;
+            if (SlotHeads[i].Data == nullptr)
+                LogWarn("Unable to allocate slot head cache")
+        }
+
+        // warm the cache with the most recently saved slots
+        for (int i = 0; i < SlotHeadCacheSize; i++)
+        {
+            int bestSlot = 0;
+            uint32_t bestSequence = 0;
+            for (int slot = 1; slot <= SlotCount; slot++)
+            {
+                auto info = Catalog.Get(slot);
+                if (!info->IsPopulated() || info->Sequence <= bestSequence || FindSlotHead(slot) != nullptr)
+                    continue;
+                bestSlot = slot;
+                bestSequence = info->Sequence;
+            }
+
+            if (bestSlot == 0)
+                break;
+
+            SetRecordingFile(bestSlot);
+            SdFile saveFile;
+            float* dest = SlotHeads[i].Data;
+            if (dest == nullptr || !saveFile.open(SaveFileName, O_RDONLY))
+                continue;
+
+            int chunkCount = Catalog.Get(bestSlot)->TotalStorageArea / StorageBufferSize;
+            uint16_t checks[2];
+            bool verify = ReadSlotTrailer(saveFile, chunkCount, checks, 2, nullptr);
+            saveFile.seek(SlotHeaderSize);
+            ZeroBuffer(dest, 2 * BlockSamples);
+            ReadBlockFrom(saveFile, dest, verify ? &checks[0] : nullptr);
+            if (chunkCount > 1)
+                ReadBlockFrom(saveFile, &dest[BlockSamples], verify ? &checks[1] : nullptr);
+            saveFile.close();
+            SlotHeads[i].Slot = bestSlot;
+            SlotHeads[i].LastUsed = ++SlotHeadUseCounter;
+            LogInfof("Cached head of slot %d", bestSlot)
+        }
+    }
+
+    inline SlotHead* FindSlotHead(int slot)
+    {
+        for (int i = 0; i < SlotHeadCacheSize; i++)
+        {
+            if (SlotHeads[i].Slot == slot && SlotHeads[i].Data != nullptr)
+                return &SlotHeads[i];
+        }
+        return nullptr;
+    }
+
+    inline void StoreSlotHead(int slot, float* block0, float* block1)
+    {
+        auto head = FindSlotHead(slot);
+        if (head == nullptr)
+        {
+            // evict the least recently used entry
+            for (int i = 0; i < SlotHeadCacheSize; i++)
+            {
+                if (SlotHeads[i].Data == nullptr)
+                    continue;
+                if (head == nullptr || SlotHeads[i].LastUsed < head->LastUsed)
+                    head = &SlotHeads[i];
+            }
+        }
+        if (head == nullptr)
+            return;
+
+        Copy(head->Data, block0, BlockSamples);
+        Copy(&head->Data[BlockSamples], block1, BlockSamples);
+        head->Slot = slot;
+        head->LastUsed = ++SlotHeadUseCounter;
+    }
+
+    inline void DropSlotHead(int slot)
+    {
+        auto head = FindSlotHead(slot);
+        if (head != nullptr)
+            head->Slot = 0;
+    }
+
+    inline bool LoadSlotHead(int slot, float* block0, float* block1)
+    {
+        auto head = FindSlotHead(slot);
+        if (head == nullptr)
+            return false;
+
+        Copy(block0, head->Data, BlockSamples);
+        Copy(block1, &head->Data[BlockSamples], BlockSamples);
+        head->LastUsed = ++SlotHeadUseCounter;
+        return true;
+    }
+
+    // Safe to call from the audio callback. A new base recording overwrites every block it covers, so the old map and
+    // the slot file are dropped, but only once the I/O side gets to it
+    inline void SetMode(RecordingMode mode)
+    {
+        if (mode == RecordingMode::Recording)
+        {
+            LogicalBlocks = 0;
+            MapResetPending = true;
+            FlashOpsSubmitted = true;
+        }
+        ReadActive = mode == RecordingMode::Playback || mode == RecordingMode::Overdub;
+        WriteActive = mode == RecordingMode::Recording || mode == RecordingMode::Overdub;
+        OverdubActive = mode == RecordingMode::Overdub;
+        Mode = mode;
+    }
+
+    inline RecordingMode GetMode()
+    {
+        return Mode;
+    }
+
+    // 1.0 keeps the existing loop at unity on every overdub pass, lower values let it decay, 0 replaces it
+    inline void SetOverdubFeedback(float feedback)
+    {
+        OverdubFeedback = feedback < 0.0f ? 0.0f : (feedback > 1.0f ? 1.0f : feedback);
+    }
+
+    inline void SetSilenceGate(float gate)
+    {
+        SilenceGate = gate < 0.0f ? 0.0f : gate;
+    }
+
+    // Block ends and the loop end are only checked once per audio buffer, so a block that ends inside a buffer would
+    // play on into the next buffer at every seam. Loop lengths and silence are therefore kept to whole buffers
+    inline static int WholeBuffers(int frames)
+    {
+        return (frames + BUFFER_SIZE - 1) / BUFFER_SIZE * BUFFER_SIZE;
+    }
+
+    inline void SetTotalLength(int len)
+    {
+        len = WholeBuffers(len);
+        if (len > GetMaxLength())
+        {
+            LogWarnf("Loop length %d exceeds the buffer file, limiting to %d", len, GetMaxLength())
+            len = GetMaxLength();
+        }
+        TotalLength = len;
+        LogicalBlocks = (TotalLength + StorageBufferSize - 1) / StorageBufferSize;
+        // walking the map is left to the I/O side, until then the loop end is found from TotalLength alone
+        MapLengthPending = true;
+        FlashOpsSubmitted = true;
+        LogDebugf("Setting TotalLength to: %d :: %d blocks", TotalLength, LogicalBlocks)
+    }
+
+    // Carries out the map upkeep the audio callback asked for. Runs before every I/O operation, and must be called by
+    // anything in the loop context that edits the map, so a late request can't undo the edit. Each flag is cleared
+    // before the work, so a request arriving meanwhile is picked up by the next call
+    inline void ServiceMap()
+    {
+        if (MapResetPending)
+        {
+            MapResetPending = false;
+            DetachStreamFile();
+            ResetBlockMap();
+        }
+        if (MapLengthPending)
+        {
+            MapLengthPending = false;
+            ApplyBlockLengths();
+        }
+    }
+
+    // The loop becomes a plain run of full blocks over the first logical blocks, keeping their storage.
+    // Blocks past the end are released
+    inline void ApplyBlockLengths()
+    {
+        if (BlockMap == nullptr)
+            return;
+
+        int blocks = LogicalBlocks;
+        int length = TotalLength;
+        for (int i = 0; i < CapacityBlocks; i++)
+        {
+            if (i < blocks)
+                BlockMap[i].Frames = i == blocks - 1 ? length - i * StorageBufferSize : StorageBufferSize;
+            else
+            {
+                BlockMap[i] = MakeBlockRef(SilentBlock, StorageBufferSize, false);
+                if (Envelope != nullptr)
+                    Envelope[i] = BlockLevel();
+            }
+        }
+    }
+
+    inline int GetLength()
+    {
+        return TotalLength;
+    }
+
+    // The loop envelope, one entry per block of GetBlockCount(), or nullptr while it is unknown
+    inline const BlockLevel* GetEnvelope()
+    {
+        return EnvelopeValid && Envelope != nullptr ? Envelope : nullptr;
+    }
+
+    inline int GetBlockCount()
+    {
+        return LogicalBlocks;
+    }
+
+    // Frames from the loop start to the audio being played
+    inline int GetPlayPosition()
+    {
+        return BufIdxTotal;
+    }
+
+    // Upper bound of the loop's peak level from the envelope, or -1 when the envelope is unknown
+    inline float GetLoopPeak()
+    {
+        auto envelope = GetEnvelope();
+        if (envelope == nullptr)
+            return -1.0f;
+
+        int code = 0;
+        for (int i = 0; i < LogicalBlocks; i++)
+            code = envelope[i].Peak > code ? envelope[i].Peak : code;
+        return code == 0 ? 0.0f : DecodeLevel(code + 1);
+    }
+
+    // Repeats the loop factor times. Only the block map changes: the copies share the physical blocks of the
+    // original until they are overdubbed, so the length changes instantly without copying anything on the card
+    inline bool CanMultiply(int factor)
+    {
+        return TotalLength != 0 && factor >= 2 && (long long)LogicalBlocks * factor <= CapacityBlocks;
+    }
+
+    inline bool CanInsertSilence(int frames)
+    {
+        frames = WholeBuffers(frames);
+        return TotalLength != 0 && frames > 0 && LogicalBlocks + (frames + StorageBufferSize - 1) / StorageBufferSize <= CapacityBlocks;
+    }
+
+    inline bool MultiplyLoop(int factor)
+    {
+        if (!CanMultiply(factor))
+        {
+            LogWarnf("Cannot multiply a loop of %d blocks by %d", LogicalBlocks, factor)
+            return false;
+        }
+
+        AudioDisable();
+        // queued writes belong to the original and must land before its blocks are shared
+        ProcessFlashOperations();
+        int blocks = LogicalBlocks;
+        for (int i = 0; i < blocks; i++)
+            BlockMap[i].Owned = 0;
+        for (int k = 1; k < factor; k++)
+        {
+            for (int i = 0; i < blocks; i++)
+                BlockMap[k * blocks + i] = BlockMap[i];
+            if (Envelope != nullptr)
+                memcpy(&Envelope[k * blocks], Envelope, blocks * sizeof(BlockLevel));
+        }
+        LogicalBlocks = blocks * factor;
+        TotalLength *= factor;
+        // block 1 is kept in RAM and is now a copy of block 0
+        if (blocks == 1)
+            Copy(BufLoopStart1, BufLoopStart0, BlockSamples);
+
+        // the read ahead holds the same audio, only the block numbers past the old loop end change
+        RelabelReadAhead(blocks);
+        AudioEnable();
+        LogInfof("Multiplied loop by %d to %d samples", factor, TotalLength)
+        return true;
+    }
+
+    // Appends the given number of silent frames, rounded up to whole audio buffers, to the end of the loop, without
+    // writing anything to the card
+    inline bool InsertSilence(int frames)
+    {
+        frames = WholeBuffers(frames);
+        int added = (frames + StorageBufferSize - 1) / StorageBufferSize;
+        if (!CanInsertSilence(frames))
+        {
+            LogWarnf("Cannot add %d silent samples to a loop of %d blocks", frames, LogicalBlocks)
+            return false;
+        }
+
+        AudioDisable();
+        ProcessFlashOperations();
+        int blocks = LogicalBlocks;
+        for (int i = 0; i < added; i++)
+        {
+            BlockMap[blocks + i] = MakeBlockRef(SilentBlock, i == added - 1 ? frames - i * StorageBufferSize : StorageBufferSize, false);
+            if (Envelope != nullptr)
+                Envelope[blocks + i] = BlockLevel();
+        }
+        LogicalBlocks = blocks + added;
+        TotalLength += frames;
+        if (blocks == 1)
+            ZeroBuffer(BufLoopStart1, BlockSamples);
+
+        RelabelReadAhead(blocks);
+        AudioEnable();
+        LogInfof("Added %d silent samples, loop is now %d samples", frames, TotalLength)
+        return true;
+    }
+
+    // After the loop grew from oldBlocks, the read ahead slots that wrapped around to the loop start hold blocks
+    // that now lie further out. Copies of the loop hold the same audio and are only renumbered, anything else is
+    // refilled. Must be called with audio disabled and no flash operations in flight
+    inline void RelabelReadAhead(int oldBlocks)
+    {
+        int block = BufReadIdx;
+        for (int k = 1; k < ReadRingSize; k++)
+        {
+            int slot = (ReadRingPos + k) % ReadRingSize;
+            block = NextBlock(block);
+            if (BufReadRingIdx[slot] == block)
+                continue;
+
+            bool sameAudio = BlockMap[block].Block == BlockMap[block % oldBlocks].Block && BufReadRingIdx[slot] == block % oldBlocks;
+            BufReadRingIdx[slot] = block;
+            if (sameAudio)
+                continue;
+
+            FlashIdxRead = block;
+            if (!ReadBlockFromRam(block, BufReadRing[slot]))
+            {
+                ZeroBuffer(BufReadRing[slot], BlockSamples);
+                QueueRead(slot, k);
+            }
+        }
+        FlashIdxRead = NextBlock(block);
+    }
+
+    // Cheap enough for the audio callback: the first block plays straight from where it sits in RAM, without copying,
+    // and the remaining read ahead slots are queued for the I/O side, which serves block 1 from RAM as well
+    inline void PreparePlay()
+    {
+        LogDebug("Preparing play...")
+        auto pendingWrite = FindPendingWrite(0);
+        ReadRingPos = 0;
+        ReadGeneration++;
+        BufRead = pendingWrite != nullptr ? pendingWrite->Data : BufLoopStart0;
+        BufReadIdx = 0;
+        BufReadRingIdx[0] = 0;
+        PendingCue = -1;
+        FlashIdxRead = NextBlock(0);
+        FlashIdxWrite = 0;
+        BufIdx = 0;
+        BufIdxTotal = 0;
+        // a block left half written must not be written out at the next boundary, wherever the loop went since
+        if (shouldWriteCurrentBuffer)
+            ZeroBuffer(BufWrite, BlockSamples);
+        shouldWriteCurrentBuffer = false;
+        shouldForceOverdub = false;
+        BlockInputPeak = 0.0f;
+        BlockReadPeak = 0.0f;
+        CurrentBlockFrames = BlockFrames(0);
+        for (int slot = 0; slot < ReadRingSize; slot++)
+            BufReadRingPending[slot] = false;
+        for (int slot = 1; slot < ReadRingSize; slot++)
+            QueueRead(slot, slot);
+    }
+
+    // Fills dest from data already in RAM: a write that hasn't reached the card yet, or the cached loop start blocks
+    inline bool ReadBlockFromRam(int block, float* dest)
+    {
+        auto pendingWrite = FindPendingWrite(block);
+        if (pendingWrite != nullptr)
+            Copy(dest, pendingWrite->Data, BlockSamples);
+        else if (block == 0)
+            Copy(dest, BufLoopStart0, BlockSamples);
+        else if (block == 1)
+            Copy(dest, BufLoopStart1, BlockSamples);
+        else
+            return false;
+        return true;
+    }
+
+    inline void AdvanceRead()
+    {
+        LogDebugf("Advance Read with %d samples. OpId %d", BufIdx, OperationId)
+
+        // the slot we just finished playing becomes the furthest read ahead slot
+        int freedSlot = ReadRingPos;
+        ReadRingPos = (ReadRingPos + 1) % ReadRingSize;
+        BufRead = BufReadRing[ReadRingPos];
+        BufReadIdx = BufReadRingIdx[ReadRingPos];
+        CurrentBlockFrames = BlockFrames(BufReadIdx);
+        if (BufReadRingPending[ReadRingPos])
+        {
+            // the slot still holds whatever it was last filled with, silence is the lesser evil
+            Diagnostics.ReadMisses++;
+            ZeroBuffer(BufRead, BlockSamples);
+        }
+        QueueRead(freedSlot, ReadAheadBlocks);
+
+        shouldReadCurrentBuffer = false;
+        OperationId++;
+    }
+
+    // Queues a read of the block at FlashIdxRead into the given ring slot, which will become current in blocksAhead blocks
+    inline void QueueRead(int slot, int blocksAhead)
+    {
+        QueueReadDue(slot, blocksAhead * BlockPeriodUs);
+    }
+
+    inline void QueueReadDue(int slot, uint32_t dueInUs)
+    {
+        if (ReadOps[ReadOpsHead].Pending)
+            LogWarn("While trying to read - operations have not completed!")
+        auto now = micros();
+        ReadOps[ReadOpsHead].FlashIdx = FlashIdxRead;
+        ReadOps[ReadOpsHead].OperationId = OperationId;
+        ReadOps[ReadOpsHead].Slot = slot;
+        ReadOps[ReadOpsHead].Generation = ReadGeneration;
+        ReadOps[ReadOpsHead].SubmitUs = now;
+        ReadOps[ReadOpsHead].DeadlineUs = now + dueInUs;
+        ReadOps[ReadOpsHead].Pending = true;
+        BufReadRingIdx[slot] = FlashIdxRead;
+        BufReadRingPending[slot] = true;
+        FlashOpsSubmitted = true;
+        ReadOpsHead = (ReadOpsHead + 1) % ReadOpBufferSize;
+        FlashIdxRead = NextBlock(FlashIdxRead);
+    }
+
+    // Places a cue point every spacing frames, starting at the loop start. If the loop holds more than MaxCuePoints,
+    // the spacing is widened by whole multiples so the cues still cover the entire loop. Caches the block of each cue.
+    // betweenReads is called after each block read, so the caller can keep servicing I/O while the cues are built
+    inline void SetCuePoints(int spacing, void (*betweenReads)() = nullptr)
+    {
+        ServiceMap();
+        PendingCue = -1;
+        CueCount = 0;
+        if (spacing <= 0 || TotalLength <= 0 || CueCache == nullptr)
+            return;
+
+        int positions = (TotalLength + spacing - 1) / spacing;
+        int stride = (positions + MaxCuePoints - 1) / MaxCuePoints;
+        int count = 0;
+        int block = 0;
+        int blockStart = 0;
+        int used = 0;
+        for (int pos = 0; pos < TotalLength && count < MaxCuePoints; pos += spacing * stride)
+        {
+            // blocks may end early after a multiply, so walk the map rather than dividing
+            while (block < LogicalBlocks - 1 && blockStart + BlockFrames(block) <= pos)
+            {
+                blockStart += BlockFrames(block);
+                block++;
+            }
+
+            // playback only starts at the cue, so the frames before it are left out of the cache
+            int start = (pos - blockStart) / BUFFER_SIZE * BUFFER_SIZE;
+            float* data;
+            if (block <= 1)
+            {
+                data = block == 0 ? BufLoopStart0 : BufLoopStart1;
+                start = 0;
+            }
+            else
+            {
+                // the whole block is read before its head is dropped, so it needs a full block of room
+                if (used + BlockSamples > CueCacheBlocks * BlockSamples)
+                {
+                    LogWarnf("Cue cache full, keeping %d cue points", count)
+                    break;
+                }
+                data = &CueCache[used];
+                ReadLoopBlock(block, data);
+                int tail = BlockSamples - start * Channels;
+                memmove(data, &data[start * Channels], tail * sizeof(float));
+                used += tail;
+            }
+
+            CuePoints[count] = pos;
+            CueCacheIdx[count] = block;
+            CueBlockStart[count] = blockStart;
+            CueCacheStart[count] = start;
+            CueData[count] = data;
+            // published one at a time, so writes landing while the rest are read keep the cached ones current
+            CueCount = ++count;
+            if (betweenReads != nullptr)
+                betweenReads();
+        }
+
+        LogInfof("Set %d cue points, %d frames apart", CueCount, spacing * stride)
+    }
+
+    inline int GetCueCount()
+    {
+        return CueCount;
+    }
+
+    // Requests playback to continue from the given cue point at the next block boundary
+    inline void JumpToCue(int cue)
+    {
+        if (cue < 0 || cue >= CueCount)
+            return;
+        PendingCue = cue;
+    }
+
+    // Continues from the cue point right away rather than at the next block boundary. Audio callback only, used to
+    // start playback from a cue while stopped, after PreparePlay
+    inline void StartAtCue(int cue)
+    {
+        if (cue < 0 || cue >= CueCount)
+            return;
+        PendingCue = -1;
+        ApplyCueJump(cue, BUFFER_SIZE);
+    }
+
+    // Reads a block of the current loop, preferring data that hasn't reached the card yet
+    inline void ReadLoopBlock(int block, float* dest)
+    {
+        if (!ReadBlockFromRam(block, dest))
+            ReadStoredBlock(block, dest);
+    }
+
+    // Makes the cached cue block current and restarts the read ahead behind it.
+    // The in-block offset is rounded down to the audio buffer size, so buffers stay aligned with the block
+    inline void ApplyCueJump(int cue, int bufSize)
+    {
+        int pos = CuePoints[cue];
+        int block = CueCacheIdx[cue];
+        int blockStart = CueBlockStart[cue];
+        int blockFrames = BlockFrames(block);
+        int start = CueCacheStart[cue];
+        int offset = (pos - blockStart) / bufSize * bufSize;
+        offset = offset < start ? start : offset;
+
+        // the first read is due when the remainder of the cue block has played
+        uint32_t remainderUs = (uint32_t)((long long)(blockFrames - offset) * BlockPeriodUs / StorageBufferSize);
+
+        ReadGeneration++;
+        ReadRingPos = (ReadRingPos + 1) % ReadRingSize;
+        BufRead = BufReadRing[ReadRingPos];
+        BufReadIdx = block;
+        CurrentBlockFrames = blockFrames;
+        FlashIdxRead = block;
+        if (start == 0)
+        {
+            Copy(BufRead, CueData[cue], BlockSamples);
+            BufReadRingIdx[ReadRingPos] = block;
+            BufReadRingPending[ReadRingPos] = false;
+            FlashIdxRead = NextBlock(block);
+        }
+        else
+        {
+            // the head of the block isn't cached. It is read in behind the cached part, since an overdub writes the
+            // whole block back when it ends
+            Copy(&BufRead[offset * Channels], &CueData[cue][(offset - start) * Channels], BlockSamples - offset * Channels);
+            QueueReadDue(ReadRingPos, remainderUs);
+        }
+        for (int k = 1; k < ReadRingSize; k++)
+        {
+            int slot = (ReadRingPos + k) % ReadRingSize;
+            QueueReadDue(slot, remainderUs + (k - 1) * BlockPeriodUs);
+        }
+
+        FlashIdxWrite = block;
+        BufIdx = offset;
+        BufIdxTotal = blockStart + offset;
+        // the part of the block before the offset was never played, so it can't be known to be silent
+        BlockReadPeak = offset > 0 ? 1.0f : 0.0f;
+        OperationId++;
+    }
+
+    inline void AdvanceWrite()
+    {
+        LogDebugf("Advance Write with %d samples. OpId %d", BufIdx, OperationId)
+
+        // a free recording that runs past the end of the buffer file is cut off, the controller closes the loop
+        if (FlashIdxWrite >= CapacityBlocks)
+        {
+            LogWarnf("Buffer file full, dropping block at %d", FlashIdxWrite)
+            ZeroBuffer(BufWrite, BlockSamples);
+            BlockInputPeak = 0.0f;
+            shouldWriteCurrentBuffer = false;
+            shouldForceOverdub = false;
+            OperationId++;
+            return;
+        }
+
+        // the peaks gathered while the block played tell whether the write can be skipped or stored as silence
+        bool inputSilent = BlockInputPeak < SilenceGate;
+        // a punch in or out part way through the block leaves frames that were only played, those keep their level
+        bool partial = shouldForceOverdub && (OverdubFromFrame > 0 || OverdubToFrame < BlockSize);
+        bool unchanged = shouldForceOverdub && inputSilent && OverdubFeedback == 1.0f;
+        bool silent = inputSilent && (!shouldForceOverdub || BlockReadPeak * (partial ? 1.0f : OverdubFeedback) < SilenceGate);
+        // after a read miss, or a cue jump whose block head hasn't arrived, the existing block isn't all in RAM.
+        // Keeping the stored block loses this pass of the overdub, writing it back would lose the loop
+        bool incomplete = shouldForceOverdub && BufReadRingPending[ReadRingPos];
+        if (unchanged || incomplete)
+        {
+            if (incomplete)
+                LogWarnf("Block %d was not read in completely, dropping its overdub", BufReadIdx)
+            else
+                Diagnostics.SkippedWrites++;
+            ZeroBuffer(BufWrite, BlockSamples);
+        }
+        else
+        {
+            if (WriteOps[WriteOpsHead].Pending)
+            {
+                LogWarn("While trying to write - operations have not completed!")
+                Diagnostics.WriteOverruns++;
+            }
+            auto now = micros();
+            WriteOps[WriteOpsHead].FlashIdx = shouldForceOverdub ? BufReadIdx : FlashIdxWrite;
+            WriteOps[WriteOpsHead].OperationId = OperationId;
+            WriteOps[WriteOpsHead].SubmitUs = now;
+            WriteOps[WriteOpsHead].DeadlineUs = now + OpBufferSize * BlockPeriodUs;
+            WriteOps[WriteOpsHead].Silent = silent;
+            WriteOps[WriteOpsHead].Pending = true;
+            FlashOpsSubmitted = true;
+            // feedback only applies to the frames overdubbed, the rest get the remainder added back
+            if (partial && OverdubFeedback != 1.0f && !silent)
+            {
+                KeepExisting(0, OverdubFromFrame);
+                KeepExisting(OverdubToFrame, BlockSize);
+            }
+            // mixing, feedback and clearing the input block all happen in a single pass into the op buffer
+            if (silent)
+            {
+                ZeroBuffer(WriteOps[WriteOpsHead].Data, BlockSamples);
+                ZeroBuffer(BufWrite, BlockSamples);
+                Diagnostics.SparseWrites++;
+            }
+            else
+            {
+                float sumSquares;
+                float peak = shouldForceOverdub && OverdubFeedback != 0.0f
+                    ? OverdubBlock<BlockSamples>(WriteOps[WriteOpsHead].Data, BufWrite, BufRead, OverdubFeedback, &sumSquares)
+                    : MoveBlock<BlockSamples>(WriteOps[WriteOpsHead].Data, BufWrite, &sumSquares);
+                WriteOps[WriteOpsHead].Level = MakeBlockLevel(peak, sumSquares, BlockSamples);
+            }
+            if (shouldForceOverdub)
+                LogDebugf("Overdubbing, using BufReadIdx as flash Index: %d", BufReadIdx)
+            WriteOpsHead = (WriteOpsHead + 1) % OpBufferSize;
+        }
+        FlashIdxWrite++;
+        if (FlashIdxWrite >= LogicalBlocks && TotalLength != 0)
+            FlashIdxWrite = 0;
+
+        BlockInputPeak = 0.0f;
+        shouldWriteCurrentBuffer = false;
+        shouldForceOverdub = false;
+        OperationId++;
+    }
+
+    bool shouldReadCurrentBuffer = false;
+    bool shouldWriteCurrentBuffer = false;
+    bool shouldForceOverdub = false;
+    // the frames of the current block played while overdubbing, feedback is applied to these only
+    int OverdubFromFrame = 0;
+    int OverdubToFrame = 0;
+
+    // Adds back the part of the existing audio that feedback takes away, for frames that weren't overdubbed
+    inline void KeepExisting(int fromFrame, int toFrame)
+    {
+        float keep = 1.0f - OverdubFeedback;
+        for (int i = fromFrame * Channels; i < toFrame * Channels; i++)
+            BufWrite[i] += keep * BufRead[i];
+    }
+
+    // Writes out the block being overdubbed when the overdub ends part way through it, before PreparePlay moves the
+    // position. The part not played yet lies outside the overdubbed frames, so it is stored as it was
+    inline void FlushOverdub()
+    {
+        if (!shouldWriteCurrentBuffer)
+            return;
+
+        if (shouldForceOverdub)
+        {
+            float peak = 0.0f;
+            for (int i = BufIdx * Channels; i < BlockSamples; i++)
+            {
+                float val = BufRead[i];
+                float mag = val < 0.0f ? -val : val;
+                peak = mag > peak ? mag : peak;
+            }
+            // the unplayed part counts towards the read peak, or a quiet start would get the block stored as silence
+            BlockReadPeak = peak > BlockReadPeak ? peak : BlockReadPeak;
+        }
+        AdvanceWrite();
+    }
+
+    // Mono entry point, only available for single channel configurations
+    inline void Process(float* input, float* output, int bufSize)
+    {
+        static_assert(Channels == 1, "Use the multi channel Process overload for interleaved storage");
+        Process(&input, &output, bufSize);
+    }
+
+    // The audio block size only has to divide the storage block size, so 16 and 32 sample blocks work for low latency
+    // monitoring. Everything done once per call is kept to a few flag tests; the per block work happens at the boundary.
+    // When the loop isn't playing the outputs are cleared, so callers don't need to clear them first
+    inline void Process(float** inputs, float** outputs, int bufSize)
+    {
+        auto shouldReadNow = ReadActive;
+        auto shouldWriteNow = WriteActive;
+
+        // the block that just ended is written as it was played, a mode change on the boundary applies to the next one
+        if (BufIdx >= CurrentBlockFrames || (BufIdxTotal >= TotalLength && TotalLength != 0))
+        {
+            if (shouldWriteCurrentBuffer)
+                AdvanceWrite();
+
+            int cue = PendingCue;
+            if (cue >= 0 && cue < CueCount && shouldReadNow)
+            {
+                PendingCue = -1;
+                ApplyCueJump(cue, bufSize);
+                shouldReadCurrentBuffer = false;
+            }
+            else
+            {
+                if (shouldReadCurrentBuffer)
+                    AdvanceRead();
+                BlockReadPeak = 0.0f;
+
+                if (BufIdxTotal >= TotalLength && TotalLength != 0)
+                {
+                    BufIdxTotal = 0;
+                }
+                BufIdx = 0;
+            }
+        }
+
+        shouldReadCurrentBuffer = shouldReadCurrentBuffer || shouldReadNow;
+        shouldWriteCurrentBuffer = shouldWriteCurrentBuffer || shouldWriteNow;
+        if (OverdubActive)
+        {
+            if (!shouldForceOverdub)
+                OverdubFromFrame = BufIdx;
+            else if (OverdubToFrame < BufIdx && OverdubFeedback != 1.0f)
+                KeepExisting(OverdubToFrame, BufIdx); // punched out and back in within the block
+            OverdubToFrame = BufIdx + bufSize;
+            shouldForceOverdub = true;
+        }
+
+        if (shouldReadNow)
+        {
+            float peak = Deinterleave(outputs, &BufRead[BufIdx * Channels], bufSize);
+            BlockReadPeak = peak > BlockReadPeak ? peak : BlockReadPeak;
+        }
+        else
+        {
+            for (int c = 0; c < Channels; c++)
+                ZeroBuffer(outputs[c], bufSize);
+        }
+
+        // BufWrite needs no clearing when nothing is written, the write kernels leave it zeroed at every block boundary
+        if (shouldWriteNow)
+        {
+            float peak = Interleave(&BufWrite[BufIdx * Channels], inputs, bufSize);
+            BlockInputPeak = peak > BlockInputPeak ? peak : BlockInputPeak;
+        }
+
+        BufIdx += bufSize;
+        BufIdxTotal += bufSize;
+    }
+
+    // Both return the peak of the samples copied, which costs next to nothing while the samples pass through anyway
+    inline float Interleave(float* dest, float** src, int frames)
+    {
+        if (Channels == 1)
+            return CopyPeak(dest, src[0], frames);
+
+        float peak = 0.0f;
+        for (int i = 0; i < frames; i++)
+        {
+            for (int c = 0; c < Channels; c++)
+            {
+                float val = src[c][i];
+                dest[i * Channels + c] = val;
+                float mag = val < 0.0f ? -val : val;
+                peak = mag > peak ? mag : peak;
+            }
+        }
+        return peak;
+    }
+
+    inline float Deinterleave(float** dest, const float* src, int frames)
+    {
+        if (Channels == 1)
+            return CopyPeak(dest[0], src, frames);
+
+        float peak = 0.0f;
+        for (int i = 0; i < frames; i++)
+        {
+            for (int c = 0; c < Channels; c++)
+            {
+                float val = src[i * Channels + c];
+                dest[c][i] = val;
+                float mag = val < 0.0f ? -val : val;
+                peak = mag > peak ? mag : peak;
+            }
+        }
+        return peak;
+    }
+
+    inline void ProcessReadOperation(FlashReadOp* op)
+    {
+        auto t1 = micros();
+        LogDebugf("Processing Read operation %d. Reading from flashIdx %d", op->OperationId, op->FlashIdx)
+
+        if (op->Generation != ReadGeneration)
+        {
+            LogDebugf("Dropping stale read operation %d", op->OperationId)
+            op->Pending = false;
+            return;
+        }
+
+        if (op->FlashIdx >= LogicalBlocks && TotalLength != 0)
+        {
+            LogWarnf("Trying to read out of bound flash data at Index %d - Aborting Read", op->FlashIdx)
+            ZeroBuffer(BufReadRing[op->Slot], BlockSamples);
+            BufReadRingPending[op->Slot] = false;
+            op->Pending = false;
+            return;
+        }
+
+        float* dest = BufReadRing[op->Slot];
+        auto pendingWrite = FindPendingWrite(op->FlashIdx);
+        if (pendingWrite != nullptr)
+        {
+            // reads are scheduled ahead of writes, so on short loops the newest data may not have reached the card yet
+            LogDebug("Forwarding data from pending write")
+            Copy(dest, pendingWrite->Data, BlockSamples);
+        }
+        else if (op->FlashIdx == 0)
+        {
+            LogDebug("Reading FlashIdx 0 from RAM")
+            // Cheat and read the data at index 0 from ram, not flash
+            Copy(dest, BufLoopStart0, BlockSamples);
+        }
+        else if (op->FlashIdx == 1)
+        {
+            LogDebug("Reading FlashIdx 1 from RAM")
+            // Cheat and read the data at index 1 from ram, not flash
+            Copy(dest, BufLoopStart1, BlockSamples);
+        }
+        else
+        {
+            ReadStoredBlock(op->FlashIdx, dest);
+        }
+        // a jump may have reassigned the slot while we were reading
+        if (op->Generation == ReadGeneration)
+            BufReadRingPending[op->Slot] = false;
+        op->Pending = false;
+        auto t2 = micros();
+        TrackLatency(op->SubmitUs, op->DeadlineUs, t2, &Diagnostics.MaxReadLatencyUs);
+        LogDebugf("ProcessReadOp time: %d", (t2-t1))
+    }
+
+    inline void ProcessWriteOperation(FlashWriteOp* op)
+    {
+        auto t1 = micros();
+        LogDebugf("Processing Write operation %d. Writing to flashIdx %d", op->OperationId, op->FlashIdx)
+
+        // store the first buffers in RAM for fast access
+        if (op->FlashIdx == 0)
+        {
+            LogDebug("Storing LoopStart0")
+            Copy(BufLoopStart0, op->Data, BlockSamples);
+        }
+        if (op->FlashIdx == 1)
+        {
+            LogDebug("Storing LoopStart1")
+            Copy(BufLoopStart1, op->Data, BlockSamples);
+        }
+
+        // keep cached cue blocks coherent with overdubs
+        for (int i = 0; i < CueCount; i++)
+        {
+            if (CueCacheIdx[i] == op->FlashIdx)
+                Copy(CueData[i], &op->Data[CueCacheStart[i] * Channels], BlockSamples - CueCacheStart[i] * Channels);
+        }
+        
+        if (op->Silent)
+            ReleaseBlock(op->FlashIdx);
+        else
+            WriteStoredBlock(op->FlashIdx, op->Data);
+        if (Envelope != nullptr && op->FlashIdx >= 0 && op->FlashIdx < CapacityBlocks)
+            Envelope[op->FlashIdx] = op->Silent ? BlockLevel() : op->Level;
+        op->Pending = false;
+        auto t2 = micros();
+        TrackLatency(op->SubmitUs, op->DeadlineUs, t2, &Diagnostics.MaxWriteLatencyUs);
+        LogDebugf("ProcessWriteOp time: %d", (t2-t1))
+    }
+
+    inline FlashWriteOp* FindPendingWrite(int flashIdx)
+    {
+        // newest first, in case the same block was written twice
+        for (int i = 1; i <= OpBufferSize; i++)
+        {
+            auto op = &WriteOps[(WriteOpsHead - i + OpBufferSize) % OpBufferSize];
+            if (op->Pending && op->FlashIdx == flashIdx)
+                return op;
+        }
+        return nullptr;
+    }
+
+    inline void TrackLatency(uint32_t submitUs, uint32_t deadlineUs, uint32_t completedUs, uint32_t* maxLatency)
+    {
+        uint32_t latency = completedUs - submitUs;
+        if (latency > *maxLatency)
+            *maxLatency = latency;
+        if ((int32_t)(completedUs - deadlineUs) > 0)
+            Diagnostics.DeadlineMisses++;
+    }
+
+    inline const FlashDiagnostics& GetDiagnostics()
+    {
+        return Diagnostics;
+    }
+
+    inline void ResetDiagnostics()
+    {
+        Diagnostics = FlashDiagnostics();
+    }
+
+    // Finds the most urgent pending operation. Returns false when there is nothing to do
+    inline bool PeekNextOperation(uint32_t* deadlineUs, bool* isRead) override
+    {
+        ServiceMap();
+
+        // skip over slots that were aborted
+        while (ReadOpsTail != ReadOpsHead && !ReadOps[ReadOpsTail].Pending)
+            ReadOpsTail = (ReadOpsTail + 1) % ReadOpBufferSize;
+        while (WriteOpsTail != WriteOpsHead && !WriteOps[WriteOpsTail].Pending)
+            WriteOpsTail = (WriteOpsTail + 1) % OpBufferSize;
+
+        bool hasRead = ReadOpsTail != ReadOpsHead;
+        bool hasWrite = WriteOpsTail != WriteOpsHead;
+        if (!hasRead && !hasWrite)
+            return false;
+
+        // within each queue, operations are submitted in deadline order, so only the two tails need comparing
+        if (hasRead && (!hasWrite || (int32_t)(ReadOps[ReadOpsTail].DeadlineUs - WriteOps[WriteOpsTail].DeadlineUs) <= 0))
+        {
+            *deadlineUs = ReadOps[ReadOpsTail].DeadlineUs;
+            *isRead = true;
+        }
+        else
+        {
+            *deadlineUs = WriteOps[WriteOpsTail].DeadlineUs;
+            *isRead = false;
+        }
+        return true;
+    }
+
+    // Services the single most urgent pending operation, earliest deadline first
+    inline bool ProcessNextOperation() override
+    {
+        uint32_t deadline;
+        bool isRead;
+        if (!PeekNextOperation(&deadline, &isRead))
+            return false;
+
+        if (isRead)
+        {
+            ProcessReadOperation(&ReadOps[ReadOpsTail]);
+            ReadOpsTail = (ReadOpsTail + 1) % ReadOpBufferSize;
+        }
+        else
+        {
+            ProcessWriteOperation(&WriteOps[WriteOpsTail]);
             WriteOpsTail = (WriteOpsTail + 1) % OpBufferSize;
         }
+        return true;
+    }
+
+    inline void ProcessFlashOperations()
+    {
+        while (ProcessNextOperation())
+        {
+        }
     }
 };
+
+typedef FlashReaderWriterT<> FlashReaderWriter;
@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+#include "Polygons.h"
+#include "FlashReaderWriter.h"
+
+using namespace Polygons;
+
+// Services flash operations of all registered channels, earliest deadline first.
+// Instead of sleeping a fixed time between polls, the main loop waits until the audio callback submits an
+// operation (or a timeout elapses), and long running background work calls Poll() between steps so it never
+// holds up a read the audio callback is about to need.
+class IoScheduler
+{
+    const static int MaxChannels = 4;
+    FlashChannel* Channels[MaxChannels];
+    int ChannelCount = 0;
+    uint32_t LastRunUs = 0;
+
+public:
+    // Ops are rechecked at least this often even without a submission, so nothing waits on a missed wake up
+    const static uint32_t IdlePollUs = 2000;
+
+    inline void Register(FlashChannel* channel)
+    {
+        for (int i = 0; i < ChannelCount; i++)
+        {
+            if (Channels[i] == channel)
+                return;
+        }
+
+        if (ChannelCount >= MaxChannels)
+        {
+            LogError("Too many channels registered with the I/O scheduler")
+            return;
+        }
+        Channels[ChannelCount++] = channel;
+    }
+
+    // Runs all pending operations across channels in deadline order. Returns the number of operations serviced
+    inline int Run()
+    {
+        FlashOpsSubmitted = false;
+        LastRunUs = micros();
+        int count = 0;
+
+        while (true)
+        {
+            FlashChannel* next = nullptr;
+            uint32_t nextDeadline = 0;
+            for (int i = 0; i < ChannelCount; i++)
+            {
+                uint32_t deadline;
+                bool isRead;
+                if (!Channels[i]->PeekNextOperation(&deadline, &isRead))
+                    continue;
+                if (next == nullptr || (int32_t)(deadline - nextDeadline) < 0)
+                {
+                    next = Channels[i];
+                    nextDeadline = deadline;
+                }
+            }
+
+            if (next == nullptr)
+                break;
+
+            next->ProcessNextOperation();
+            count++;
+        }
+
+        return count;
+    }
+
+    // Cheap check for background jobs to call between steps of work
+    inline void Poll()
+    {
+        if (FlashOpsSubmitted || micros() - LastRunUs >= IdlePollUs)
+            Run();
+    }
+
+    // Replacement for a fixed delay in the main loop: sleeps until the audio callback submits work or the timeout
+    // elapses, then services everything that is pending
+    inline void WaitAndRun(uint32_t timeoutUs)
+    {
+        auto start = micros();
+        while (!FlashOpsSubmitted && micros() - start < timeoutUs)
+            asm volatile("wfi"); // any interrupt wakes us, including the audio interrupt which submits the ops
+
+        Run();
+    }
+};
+
+IoScheduler FlashScheduler;
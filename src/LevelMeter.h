@@ -0,0 +1,87 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+#include "Constants.h"
+
+// Levels are kept as one byte codes on a dB scale: 0 is silence (below LevelFloorDb), 1..255 span LevelFloorDb to
+// LevelCeilingDb in steps of about 0.43 dB. The ceiling sits above full scale because overdubbed float loops can exceed it
+const static float LevelFloorDb = -96.0f;
+const static float LevelCeilingDb = 12.0f;
+
+inline uint8_t EncodeLevel(float level)
+{
+    if (level <= 0.0f)
+        return 0;
+    float db = 20.0f * log10f(level);
+    if (db < LevelFloorDb)
+        return 0;
+    int code = 1 + (int)((db - LevelFloorDb) * (254.0f / (LevelCeilingDb - LevelFloorDb)));
+    return code > 255 ? 255 : (uint8_t)code;
+}
+
+// The lowest level that encodes to the code, so DecodeLevel(code + 1) bounds the level from above
+inline float DecodeLevel(int code)
+{
+    if (code <= 0)
+        return 0.0f;
+    float db = LevelFloorDb + (code - 1) * ((LevelCeilingDb - LevelFloorDb) / 254.0f);
+    return powf(10.0f, db / 20.0f);
+}
+
+// Loudness summary of one storage block, two bytes so the envelope of a whole loop fits in RAM
+struct BlockLevel
+{
+    uint8_t Peak = 0;
+    uint8_t Rms = 0;
+};
+
+inline BlockLevel MakeBlockLevel(float peak, float sumSquares, int count)
+{
+    BlockLevel level;
+    level.Peak = EncodeLevel(peak);
+    level.Rms = EncodeLevel(sqrtf(sumSquares / count));
+    return level;
+}
+
+// Peak and RMS of one audio channel for display. The peak falls back over about half a second, the RMS is smoothed
+// over roughly 300 ms, both updated once per audio block from values gathered in a pass the callback makes anyway
+class ChannelMeter
+{
+    float PeakHold = 0.0f;
+    float MeanSquare = 0.0f;
+
+public:
+    // Measures an audio buffer in a single pass and returns its peak
+    inline float Measure(const float* buffer, int count)
+    {
+        float peak = 0.0f;
+        float sumSquares = 0.0f;
+        for (int i = 0; i < count; i++)
+        {
+            float val = buffer[i];
+            float mag = val < 0.0f ? -val : val;
+            peak = mag > peak ? mag : peak;
+            sumSquares += val * val;
+        }
+        Update(peak, sumSquares, count);
+        return peak;
+    }
+
+    inline void Update(float peak, float sumSquares, int count)
+    {
+        float decay = 1.0f - count / (0.5f * SAMPLERATE);
+        PeakHold = peak > PeakHold * decay ? peak : PeakHold * decay;
+        float alpha = count / (0.3f * SAMPLERATE);
+        MeanSquare += (sumSquares / count - MeanSquare) * alpha;
+    }
+
+    inline float GetPeak() const
+    {
+        return PeakHold;
+    }
+
+    inline float GetRms() const
+    {
+        return sqrtf(MeanSquare);
+    }
+};
@@ -14,11 +14,15 @@ namespace DejaVu
         static const int SetLength = 4;
         static const int SetLengthMode = 5;
         static const int Bpm = 6;
+        static const int Slice = 7;
+        static const int Feedback = 8;
+        static const int LoopEdit = 9;
+        static const int SaveMode = 10;
 
-        static const int COUNT = 7;
+        static const int COUNT = 11;
     };
 
-    uint16_t DefaultValues[7] = 
+    uint16_t DefaultValues[Parameter::COUNT] = 
     {
         0,
         512,
@@ -27,5 +31,9 @@ namespace DejaVu
         263,
         768,
         390,
+        0,
+        1023,
+        0,
+        0,
     };
 }
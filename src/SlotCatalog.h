@@ -0,0 +1,153 @@
+#pragma once
+#include <SdFat.h>
+#include <stdint.h>
+#include "Polygons.h"
+#include "Utils.h"
+
+using namespace Polygons;
+
+const static int SlotCount = 30;
+
+enum class SlotFormat
+{
+    Empty = 0,
+    // slot file: int length, int storage area, the raw blocks in the sample type below, then the block check trailer
+    Float32 = 1,
+    Int16 = 2,
+    Int32 = 3,
+};
+
+struct SlotInfo
+{
+    int32_t TotalLength = 0;
+    int32_t TotalStorageArea = 0;
+    int32_t Format = (int32_t)SlotFormat::Empty;
+    int32_t Bpm = 0;
+    uint32_t Checksum = 0; // 0 = unknown, e.g. when the entry was rebuilt from a slot file header
+    uint32_t Sequence = 0; // increments on every save, used to decide which slot heads to keep cached
+
+    inline bool IsPopulated() const
+    {
+        return Format != (int32_t)SlotFormat::Empty;
+    }
+};
+
+// Compact on-card index of all save slots.
+// Loaded once at boot, entries are rewritten in place when a slot is saved, so the UI never needs to probe the slot files.
+class SlotCatalog
+{
+    const static uint32_t Magic = 0x58495644; // "DVIX"
+    const static int32_t Version = 1;
+
+    struct Header
+    {
+        uint32_t Magic;
+        int32_t Version;
+        int32_t Count;
+    };
+
+    char IndexFileName[70];
+    SlotInfo Slots[SlotCount];
+    uint32_t Sequence = 0;
+
+public:
+
+    inline void SetFileName(const char* bufferFileName)
+    {
+        strcpy(IndexFileName, bufferFileName);
+        strcat(IndexFileName, ".idx");
+    }
+
+    inline bool Load()
+    {
+        SdFile indexFile;
+        if (!indexFile.open(IndexFileName, O_RDONLY))
+            return false;
+
+        Header header;
+        int headerRead = indexFile.read((uint8_t*)&header, sizeof(Header));
+        if (headerRead != sizeof(Header) || header.Magic != Magic || header.Version != Version || header.Count != SlotCount)
+        {
+            LogWarnf("Slot index %s is invalid, ignoring it", IndexFileName)
+            indexFile.close();
+            return false;
+        }
+
+        int slotsRead = indexFile.read((uint8_t*)Slots, sizeof(Slots));
+        indexFile.close();
+        if (slotsRead != sizeof(Slots))
+        {
+            LogWarnf("Slot index %s is truncated, ignoring it", IndexFileName)
+            Clear();
+            return false;
+        }
+
+        for (int i = 0; i < SlotCount; i++)
+        {
+            if (Slots[i].Sequence > Sequence)
+                Sequence = Slots[i].Sequence;
+        }
+
+        LogInfof("Loaded slot index %s", IndexFileName)
+        return true;
+    }
+
+    inline bool Store()
+    {
+        SdFile indexFile;
+        if (!indexFile.open(IndexFileName, O_RDWR | O_CREAT | O_TRUNC))
+        {
+            LogError("Failed to open slot index")
+            return false;
+        }
+
+        Header header = { Magic, Version, SlotCount };
+        indexFile.write((uint8_t*)&header, sizeof(Header));
+        indexFile.write((uint8_t*)Slots, sizeof(Slots));
+        indexFile.close();
+        return true;
+    }
+
+    inline void Clear()
+    {
+        for (int i = 0; i < SlotCount; i++)
+            Slots[i] = SlotInfo();
+        Sequence = 0;
+    }
+
+    inline const SlotInfo* Get(int slot) const
+    {
+        if (slot < 1 || slot > SlotCount)
+            return nullptr;
+        return &Slots[slot - 1];
+    }
+
+    // Stores the entry in RAM, without touching the card. Used while rebuilding the index.
+    inline void Set(int slot, const SlotInfo& info)
+    {
+        if (slot < 1 || slot > SlotCount)
+            return;
+        Slots[slot - 1] = info;
+        if (info.Sequence > Sequence)
+            Sequence = info.Sequence;
+    }
+
+    // Stores the entry and rewrites only that entry in the index file.
+    inline bool Update(int slot, SlotInfo info)
+    {
+        if (slot < 1 || slot > SlotCount)
+            return false;
+
+        info.Sequence = ++Sequence;
+        Slots[slot - 1] = info;
+
+        SdFile indexFile;
+        if (!indexFile.open(IndexFileName, O_RDWR))
+            return Store();
+
+        indexFile.seek(sizeof(Header) + (slot - 1) * sizeof(SlotInfo));
+        indexFile.write((uint8_t*)&Slots[slot - 1], sizeof(SlotInfo));
+        indexFile.close();
+        return true;
+    }
+};
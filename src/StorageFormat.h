@@ -0,0 +1,90 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+
+// Conversion between the float blocks used by the audio path and the sample type stored on the card.
+// Encoding and decoding happen on the I/O side only, the audio callback always works on float blocks.
+
+template <typename SampleT>
+struct SampleTraits
+{
+};
+
+template <>
+struct SampleTraits<float>
+{
+    static constexpr int Format = 1; // matches SlotFormat::Float32
+};
+
+template <>
+struct SampleTraits<int16_t>
+{
+    static constexpr int Format = 2; // matches SlotFormat::Int16
+    static constexpr float Scale = 32767.0f;
+    static constexpr float Max = 32767.0f;
+};
+
+template <>
+struct SampleTraits<int32_t>
+{
+    static constexpr int Format = 3; // matches SlotFormat::Int32
+    // a power of two, so scaling is exact both ways and a decoded block encodes back to the same codes
+    static constexpr float Scale = 2147483648.0f;
+    static constexpr float Max = 2147483520.0f; // largest float below 2^31, so clamped samples can't overflow
+};
+
+template <typename SampleT, int Count>
+class StorageCodec
+{
+    SampleT Scratch[Count];
+
+public:
+    // Returns the encoded bytes of a float block, valid until the next call
+    inline const uint8_t* Encode(const float* src)
+    {
+        const float scale = SampleTraits<SampleT>::Scale;
+        const float max = SampleTraits<SampleT>::Max;
+        for (int i = 0; i < Count; i++)
+        {
+            float val = src[i] * scale;
+            val = val > max ? max : (val < -max ? -max : val);
+            // rounded rather than truncated, or every read-modify-write pass would pull samples towards zero
+            Scratch[i] = (SampleT)lrintf(val);
+        }
+        return (const uint8_t*)Scratch;
+    }
+
+    // Where raw bytes destined for the float block dest should be read to
+    inline uint8_t* RawTarget(float* dest)
+    {
+        return (uint8_t*)Scratch;
+    }
+
+    // Converts the raw bytes previously read to RawTarget(dest) into dest
+    inline void Decode(float* dest)
+    {
+        const float scale = 1.0f / SampleTraits<SampleT>::Scale;
+        for (int i = 0; i < Count; i++)
+            dest[i] = Scratch[i] * scale;
+    }
+};
+
+// Float storage is the block itself, no conversion and no scratch memory
+template <int Count>
+class StorageCodec<float, Count>
+{
+public:
+    inline const uint8_t* Encode(const float* src)
+    {
+        return (const uint8_t*)src;
+    }
+
+    inline uint8_t* RawTarget(float* dest)
+    {
+        return (uint8_t*)dest;
+    }
+
+    inline void Decode(float* dest)
+    {
+    }
+};